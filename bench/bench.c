@@ -0,0 +1,450 @@
+// Allocator benchmarks. bench only calls the standard malloc() interface, so the allocator under test is picked with
+// LD_PRELOAD (see run.sh). Every run prints one CSV line:
+//     allocator,workload,threads,ops,seconds,mops_per_s,peak_rss_kb,peak_live_kb,cache_misses
+// peak_live_kb is only measured by the frag workload; peak_rss_kb / peak_live_kb is then its fragmentation.
+// cache_misses is the hardware counter for the whole run, all threads, in user space; -1 where the kernel has none
+// to give (in most VMs, or with perf_event_paranoid above 2).
+//
+// usage: bench <workload> [threads] [ops per thread]
+//     churn     every thread frees and allocates random small sizes in a private array of slots
+//     prodcons  half the threads allocate, the other half free what they are handed through a ring
+//     larson    like churn, but every round the arrays are handed to new threads, which free the old blocks
+//     xmalloc   threads allocate batches, put them on a shared stack and free batches other threads made
+//     realloc   a few buffers per thread grow in small steps up to 1 MiB
+//     frag      fill up with small blocks, free most of them, then allocate bigger ones
+//     walk      every thread keeps a linked list of small nodes, replaces random ones and walks the list now and then
+#include <stdio.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+struct worker
+{
+    pthread_t thread;
+    unsigned id;
+    size_t ops;
+    uint64_t rng;
+    void **slots;    // larson: the array this thread works on
+    size_t live, peak_live;
+};
+
+static unsigned nthreads;
+static size_t ops_per_thread;
+
+static uint64_t next_random(struct worker *w)
+{
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+// Mostly small, some medium, a few larger sizes, like typical programs.
+static size_t random_size(struct worker *w)
+{
+    uint64_t r = next_random(w);
+    unsigned p = r % 100;
+    r >>= 8;
+    if (p < 80)
+        return 8 + r % 120;
+    if (p < 95)
+        return 128 + r % 896;
+    return 1024 + r % 7168;
+}
+
+static void touch(void *block, size_t size)
+{
+    memset(block, 0x5a, size < 64 ? size : 64);
+}
+
+#define CHURN_SLOTS 1024
+
+static void *churn(void *arg)
+{
+    struct worker *w = arg;
+    void **slots = calloc(CHURN_SLOTS, sizeof *slots);
+    size_t i, size;
+    unsigned s;
+    for (i = 0; i < w->ops; i++)
+    {
+        s = next_random(w) % CHURN_SLOTS;
+        free(slots[s]);
+        size = random_size(w);
+        slots[s] = malloc(size);
+        touch(slots[s], size);
+    }
+    for (s = 0; s < CHURN_SLOTS; s++)
+        free(slots[s]);
+    free(slots);
+    return NULL;
+}
+
+// One single-producer single-consumer ring per producer/consumer pair.
+#define RING_SIZE 1024
+
+struct ring
+{
+    _Atomic size_t head, tail;
+    void *entries[RING_SIZE];
+};
+
+static struct ring *rings;
+
+static void *producer(void *arg)
+{
+    struct worker *w = arg;
+    struct ring *r = &rings[w->id / 2];
+    size_t i, head, size;
+    void *block;
+    for (i = 0, head = 0; i < w->ops; i++, head++)
+    {
+        size = random_size(w);
+        block = malloc(size);
+        touch(block, size);
+        while (head - atomic_load_explicit(&r->tail, memory_order_acquire) == RING_SIZE)
+            sched_yield();
+        r->entries[head % RING_SIZE] = block;
+        atomic_store_explicit(&r->head, head + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    struct worker *w = arg;
+    struct ring *r = &rings[w->id / 2];
+    size_t i, tail;
+    for (i = 0, tail = 0; i < w->ops; i++, tail++)
+    {
+        while (atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+            sched_yield();
+        free(r->entries[tail % RING_SIZE]);
+        atomic_store_explicit(&r->tail, tail + 1, memory_order_release);
+    }
+    return NULL;
+}
+
+#define LARSON_SLOTS 1000
+#define LARSON_ROUNDS 8
+
+static void *larson(void *arg)
+{
+    struct worker *w = arg;
+    size_t i, size;
+    unsigned s;
+    for (i = 0; i < w->ops / LARSON_ROUNDS; i++)
+    {
+        s = next_random(w) % LARSON_SLOTS;
+        free(w->slots[s]);
+        size = 10 + next_random(w) % 490;
+        w->slots[s] = malloc(size);
+        touch(w->slots[s], size);
+    }
+    return NULL;
+}
+
+#define XMALLOC_BATCH 100
+
+struct batch
+{
+    struct batch *next;
+    void *blocks[XMALLOC_BATCH];
+};
+
+static struct batch *batches;
+static pthread_mutex_t batches_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void *xmalloc(void *arg)
+{
+    struct worker *w = arg;
+    struct batch *b;
+    size_t i, size;
+    unsigned j;
+    for (i = 0; i < w->ops; i += XMALLOC_BATCH)
+    {
+        b = malloc(sizeof *b);
+        for (j = 0; j < XMALLOC_BATCH; j++)
+        {
+            size = 16 + next_random(w) % 240;
+            b->blocks[j] = malloc(size);
+            touch(b->blocks[j], size);
+        }
+        pthread_mutex_lock(&batches_lock);
+        b->next = batches;
+        batches = b;
+        // Take one back, most likely one another thread made.
+        b = batches->next ? batches->next : batches;
+        if (b == batches)
+            batches = b->next;
+        else
+            batches->next = b->next;
+        pthread_mutex_unlock(&batches_lock);
+        for (j = 0; j < XMALLOC_BATCH; j++)
+            free(b->blocks[j]);
+        free(b);
+    }
+    return NULL;
+}
+
+#define REALLOC_BUFFERS 4
+#define REALLOC_MAX (1 << 20)
+
+static void *grow(void *arg)
+{
+    struct worker *w = arg;
+    char *buffers[REALLOC_BUFFERS] = {NULL};
+    size_t sizes[REALLOC_BUFFERS] = {0};
+    size_t i;
+    unsigned b;
+    for (i = 0; i < w->ops; i++)
+    {
+        b = next_random(w) % REALLOC_BUFFERS;
+        sizes[b] += 16 + next_random(w) % 48;
+        if (sizes[b] > REALLOC_MAX)
+        {
+            free(buffers[b]);
+            buffers[b] = NULL;
+            sizes[b] = 16;
+        }
+        buffers[b] = realloc(buffers[b], sizes[b]);
+        buffers[b][sizes[b] - 1] = 1;
+    }
+    for (b = 0; b < REALLOC_BUFFERS; b++)
+        free(buffers[b]);
+    return NULL;
+}
+
+static void track(struct worker *w, ptrdiff_t bytes)
+{
+    w->live += bytes;
+    if (w->live > w->peak_live)
+        w->peak_live = w->live;
+}
+
+// Small blocks fill the heap, then three quarters of them, picked at random, are replaced by bigger ones that do not fit
+// the holes left behind: an allocator that cannot merge the holes or give them back shows it in peak RSS.
+static void *frag(void *arg)
+{
+    struct worker *w = arg;
+    size_t n = w->ops / 2, i, *sizes = malloc(n * sizeof *sizes);
+    void **blocks = malloc(n * sizeof *blocks);
+    for (i = 0; i < n; i++)
+    {
+        sizes[i] = 16 + next_random(w) % 496;
+        blocks[i] = malloc(sizes[i]);
+        touch(blocks[i], sizes[i]);
+        track(w, sizes[i]);
+    }
+    for (i = 0; i < n; i++)
+    {
+        if (next_random(w) % 4)
+        {
+            free(blocks[i]);
+            track(w, -(ptrdiff_t)sizes[i]);
+            sizes[i] = 1024 + next_random(w) % 3072;
+            blocks[i] = malloc(sizes[i]);
+            memset(blocks[i], 1, sizes[i]);
+            track(w, sizes[i]);
+        }
+    }
+    for (i = 0; i < n; i++)
+        free(blocks[i]);
+    free(blocks);
+    free(sizes);
+    return NULL;
+}
+
+// Nodes of a few sizes that do not all divide a cache line, visited whole and in an order that has nothing to do with
+// their addresses, the way a pointer-chasing program would: each visit costs the lines the node straddles.
+#define WALK_NODES 16384
+#define WALK_EVERY 256
+
+struct node
+{
+    struct node *next;
+    uint64_t words; // the node's size in 8 byte words
+};
+
+static struct node *walk_node(struct worker *w)
+{
+    static const size_t sizes[] = {24, 48, 80, 96};
+    size_t size = sizes[next_random(w) % 4];
+    struct node *n = malloc(size);
+    memset(n, 0, size);
+    n->words = size / 8;
+    return n;
+}
+
+static void *walk(void *arg)
+{
+    struct worker *w = arg;
+    struct node **nodes = malloc(WALK_NODES * sizeof *nodes), *n;
+    unsigned *order = malloc(WALK_NODES * sizeof *order), t;
+    size_t i, j, k;
+    uint64_t sum = 0;
+    for (i = 0; i < WALK_NODES; i++)
+    {
+        nodes[i] = walk_node(w);
+        order[i] = i;
+    }
+    for (i = WALK_NODES - 1; i > 0; i--)
+    {
+        j = next_random(w) % (i + 1);
+        t = order[i];
+        order[i] = order[j];
+        order[j] = t;
+    }
+    for (i = 0; i < w->ops; i++)
+    {
+        j = next_random(w) % WALK_NODES;
+        free(nodes[j]);
+        nodes[j] = walk_node(w);
+        if (i % WALK_EVERY)
+            continue;
+        for (j = 0; j + 1 < WALK_NODES; j++)
+            nodes[order[j]]->next = nodes[order[j + 1]];
+        nodes[order[j]]->next = NULL;
+        for (n = nodes[order[0]]; n; n = n->next)
+            for (k = 2; k < n->words; k++)
+                sum += ((uint64_t *)n)[k]++;
+    }
+    for (i = 0; i < WALK_NODES; i++)
+        free(nodes[i]);
+    free(nodes);
+    free(order);
+    w->rng ^= sum; // so that the walks are not optimised away
+    return NULL;
+}
+
+// Counts the cache misses of this process and of the threads it starts from now on.
+static int cache_misses_open(void)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof attr);
+    attr.size = sizeof attr;
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_CACHE_MISSES;
+    attr.inherit = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long cache_misses_read(int fd)
+{
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof count) != sizeof count)
+        return -1;
+    return count;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void run(struct worker *workers, void *(*body)(void *))
+{
+    unsigned i;
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&workers[i].thread, NULL, body, &workers[i]);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+static void run_prodcons(struct worker *workers)
+{
+    unsigned i;
+    if (nthreads < 2)
+        nthreads = 2;
+    nthreads &= ~1u;
+    rings = calloc(nthreads / 2, sizeof *rings);
+    for (i = 0; i < nthreads; i++)
+        pthread_create(&workers[i].thread, NULL, i % 2 ? consumer : producer, &workers[i]);
+    for (i = 0; i < nthreads; i++)
+        pthread_join(workers[i].thread, NULL);
+    free(rings);
+}
+
+static void run_larson(struct worker *workers)
+{
+    unsigned i, round, s;
+    for (i = 0; i < nthreads; i++)
+        workers[i].slots = calloc(LARSON_SLOTS, sizeof(void *));
+    for (round = 0; round < LARSON_ROUNDS; round++)
+        run(workers, larson);
+    for (i = 0; i < nthreads; i++)
+    {
+        for (s = 0; s < LARSON_SLOTS; s++)
+            free(workers[i].slots[s]);
+        free(workers[i].slots);
+    }
+}
+
+int main(int argc, char **argv)
+{
+    const char *workload = argc > 1 ? argv[1] : "churn";
+    const char *allocator = getenv("BENCH_ALLOCATOR");
+    struct worker *workers;
+    struct rusage usage;
+    size_t live = 0;
+    double start, seconds;
+    long long misses;
+    unsigned i;
+    int counter;
+    nthreads = argc > 2 ? strtoul(argv[2], NULL, 0) : 1;
+    ops_per_thread = argc > 3 ? strtoull(argv[3], NULL, 0) : 1000000;
+    if (!nthreads)
+        nthreads = 1;
+    workers = calloc(nthreads < 2 ? 2 : nthreads, sizeof *workers);
+    for (i = 0; i < (nthreads < 2 ? 2 : nthreads); i++)
+    {
+        workers[i].id = i;
+        workers[i].ops = ops_per_thread;
+        workers[i].rng = 0x9e3779b97f4a7c15ull * (i + 1);
+    }
+    counter = cache_misses_open();
+    start = now();
+    if (!strcmp(workload, "churn"))
+        run(workers, churn);
+    else if (!strcmp(workload, "prodcons"))
+        run_prodcons(workers);
+    else if (!strcmp(workload, "larson"))
+        run_larson(workers);
+    else if (!strcmp(workload, "xmalloc"))
+        run(workers, xmalloc);
+    else if (!strcmp(workload, "realloc"))
+        run(workers, grow);
+    else if (!strcmp(workload, "frag"))
+        run(workers, frag);
+    else if (!strcmp(workload, "walk"))
+        run(workers, walk);
+    else
+    {
+        fprintf(stderr, "unknown workload %s\n", workload);
+        return 2;
+    }
+    seconds = now() - start;
+    misses = cache_misses_read(counter);
+    if (counter >= 0)
+        close(counter);
+    getrusage(RUSAGE_SELF, &usage);
+    for (i = 0; i < nthreads; i++)
+        live += workers[i].peak_live;
+    printf("%s,%s,%u,%zu,%.3f,%.2f,%ld,%zu,%lld\n", allocator ? allocator : "default", workload, nthreads,
+           ops_per_thread * nthreads, seconds, ops_per_thread * nthreads / seconds / 1e6, usage.ru_maxrss, live / 1024,
+           misses);
+    free(workers);
+    return 0;
+}
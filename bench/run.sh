@@ -0,0 +1,40 @@
+#!/bin/sh
+# Runs every workload under glibc, memalloc and, when JEMALLOC or MIMALLOC name their shared libraries, jemalloc and
+# mimalloc, and prints the CSV lines of bench/bench one after the other, so the allocators compare line by line.
+# THREADS (default "1 2 4 8 16 32 64") and OPS (per thread, default 1000000) scale the runs. With PLACEMENTS set to
+# some of "first best address next", memalloc runs once per placement policy, as memalloc-<policy>, and once more for
+# every MEMALLOC_CONF string in CONFS (say CONFS="cache_align=1"), as memalloc-<conf>.
+set -e
+dir=$(cd "$(dirname "$0")" && pwd)
+threads=${THREADS:-"1 2 4 8 16 32 64"}
+ops=${OPS:-1000000}
+
+run()
+{
+    name=$1
+    lib=$2
+    conf=$3
+    for t in $threads; do
+        for w in churn prodcons larson xmalloc realloc frag walk; do
+            MEMALLOC_CONF=$conf BENCH_ALLOCATOR=$name LD_PRELOAD=$lib "$dir/bench" $w $t $ops
+        done
+    done
+}
+
+echo allocator,workload,threads,ops,seconds,mops_per_s,peak_rss_kb,peak_live_kb,cache_misses
+run glibc ""
+if [ -z "$PLACEMENTS" ]; then
+    run memalloc "$dir/../libmemalloc.so"
+fi
+for p in $PLACEMENTS; do
+    run memalloc-$p "$dir/../libmemalloc.so" placement=$p
+done
+for c in $CONFS; do
+    run memalloc-$c "$dir/../libmemalloc.so" $c
+done
+if [ -n "$JEMALLOC" ]; then
+    run jemalloc "$JEMALLOC"
+fi
+if [ -n "$MIMALLOC" ]; then
+    run mimalloc "$MIMALLOC"
+fi
@@ -12,13 +12,33 @@
 
 // sbrk() failures return (void*) -1.
 
-// NMAP is better but we don't really care about performance right now anyway
+// mmap() is better for big blocks: such a block is its own mapping and goes straight back to the OS on free(),
+// instead of pinning the program break. Requests of mmap_threshold bytes or more take that path, everything else lives in the sbrk heap.
 
 // The malloc(size) function allocates size bytes of memory and returns a pointer to the allocated memory.
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <errno.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
 #include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/random.h>
+#include <linux/mempolicy.h>
+#include <malloc.h>
+#include "memalloc.h"
 
 // void *malloc(size_t size)
 // {
@@ -59,6 +79,12 @@ struct header_t
 // Linked list
 
 // The end of the header is where the actual memory block begins and therefore the memory provided to the caller by the allocator will be aligned to 16 bytes.
+// The header is kept to 16 bytes. Blocks sit back to back, so the next block is simply at (char *)(header + 1) + size,
+// and because sizes are multiples of 16 the low four bits of size are free to hold flags.
+// prev_size is a boundary tag: it holds the size of the block before this one, but only while that block is free
+// (PREV_FREE is set), which is exactly when we need it to merge with it.
+// Free blocks are also threaded onto a per size class free list ("bin"); those links live in the free block's own payload,
+// so finding a fit never has to look at blocks that are in use.
 typedef char ALIGN[16];
 union header
 {
@@ -66,184 +92,3959 @@ union header
     struct
     {
         /* data */
+        size_t prev_size;
         size_t size;
-        unsigned is_free;
-        union header *next;
     } s;
     ALIGN stub;
 };
 
 typedef union header header_t;
 
-// Now we got head and tail of the list
-header_t *head, *tail;
-// To prevent two or more threads from concurrently accessing memory, we will put a basic locking mechanism in place.
-// We’ll have a global lock, and before every action on memory you have to acquire the lock, and once you are done you have to release the lock.
-pthread_mutex_t global_malloc_lock;
+#define BLOCK_FREE ((size_t)1)
+#define PREV_FREE ((size_t)2)
+#define BLOCK_MMAPPED ((size_t)4)
+#define BLOCK_DIRTY ((size_t)8) // free, and on the arena's decay list
+#define BLOCK_SAMPLED ((size_t)8) // in use, and in the heap profile; only free blocks can be dirty, so they share the bit
+#define FLAG_MASK ((size_t)15)
+
+struct free_links
+{
+    header_t *prev, *next;
+    // Only free blocks with whole pages in them have room for these: the arena's decay list, newest first.
+    header_t *dirty_prev, *dirty_next;
+    uint64_t freed; // CLOCK_MONOTONIC_COARSE, in milliseconds
+};
+
+static size_t block_size(header_t *header)
+{
+    return header->s.size & ~FLAG_MASK;
+}
+
+static header_t *next_block(header_t *header)
+{
+    return (header_t *)((char *)(header + 1) + block_size(header));
+}
+
+static header_t *prev_block(header_t *header)
+{
+    return (header_t *)((char *)header - header->s.prev_size - sizeof(header_t));
+}
+
+static struct free_links *links(header_t *header)
+{
+    return (struct free_links *)(header + 1);
+}
+
+// Block sizes are rounded up to the alignment as well, otherwise the header of the next block would not be aligned.
+#define ALIGNMENT 16
+#define ALIGN_UP(x, a) (((x) + ((a) - 1)) & ~((size_t)(a) - 1))
+// What the hardware moves between caches at a time: state that threads share is laid out in whole lines of it.
+#define CACHE_LINE 64
+
+// Size classes: every multiple of 16 up to SMALL_MAX gets its own exact bin, everything above is binned by power of two.
+// A bitmap of the non-empty bins lets us jump straight to the first bin that can satisfy a request.
+#define SMALL_SHIFT 10
+#define SMALL_MAX ((size_t)1 << SMALL_SHIFT)
+#define NSMALL_BINS (SMALL_MAX / ALIGNMENT)
+#define NBINS 128
+
+// Requests at or above this size get their own mapping. Override at build time with -DMMAP_THRESHOLD=..., or set mmap_threshold before the first allocation.
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (128 * 1024)
+#endif
+size_t mmap_threshold = MMAP_THRESHOLD;
+
+// The heap grows in chunks of a quarter of its size, between HEAP_GROW_MIN and HEAP_GROW_MAX, and what the request
+// does not take stays behind as a free top block to carve the next ones from. The break only moves back once the top
+// block is bigger than trim_threshold, and then top_pad bytes of it are kept, so that freeing and allocating at the end
+// of the heap does not move the break back and forth.
+#ifndef TRIM_THRESHOLD
+#define TRIM_THRESHOLD (128 * 1024)
+#endif
+#ifndef TOP_PAD
+#define TOP_PAD (64 * 1024)
+#endif
+#define HEAP_GROW_MIN ((size_t)128 << 10)
+#define HEAP_GROW_MAX ((size_t)16 << 20)
+size_t trim_threshold = TRIM_THRESHOLD;
+size_t top_pad = TOP_PAD;
+
+// Huge pages cut TLB misses for big heaps. With HUGE_PAGES_THP every arena, the main one included, lives in mmap()-ed
+// segments that are aligned to huge pages and madvise()-d MADV_HUGEPAGE instead of growing with sbrk();
+// HUGE_PAGES_HUGETLB maps the segments from the hugetlbfs pool, falling back to THP when the pool is empty.
+// Set at build time with -DHUGE_PAGES=..., or set huge_pages before the first allocation.
+#define HUGE_PAGES_OFF 0
+#define HUGE_PAGES_THP 1
+#define HUGE_PAGES_HUGETLB 2
+#ifndef HUGE_PAGES
+#define HUGE_PAGES HUGE_PAGES_OFF
+#endif
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)
+int huge_pages = HUGE_PAGES;
+
+// Pages inside free blocks are given back to the OS once they have been free for decay_ms milliseconds; -1 never does.
+// Decay runs as the arena is used, and with decay_thread set also on a background thread, so idle processes shrink too.
+// Both are set at build time (-DDECAY_MS=..., -DDECAY_THREAD=1) or before the first allocation.
+#ifndef DECAY_MS
+#define DECAY_MS 10000
+#endif
+#ifndef DECAY_THREAD
+#define DECAY_THREAD 0
+#endif
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+long decay_ms = DECAY_MS;
+int decay_thread = DECAY_THREAD;
+
+// Hardened mode, for catching heap corruption close to where it happens. Every header whose neighbour in front is in
+// use carries a canary in its otherwise unused prev_size: its address xor a secret drawn at startup. free() checks the
+// canaries of the block and of the one behind it, which catches a header overwritten from either side, and aborts with
+// a message on a double free, whether the block is in a bin, a slab run, the thread's tcache or its quarantine. Freed
+// blocks wait in a per-thread quarantine of the last quarantine blocks, poisoned, before they can be reused, and a
+// write to one while it waits is reported when it leaves. Large blocks end right at a PROT_NONE guard page and are
+// unmapped at once on free(), so overruns and later use fault. Set with -DHARDENED=1, or hardened before the first
+// allocation.
+#ifndef HARDENED
+#define HARDENED 0
+#endif
+#ifndef QUARANTINE
+#define QUARANTINE 16
+#endif
+#define QUARANTINE_MAX 64
+#define QUARANTINE_POISON 64 // bytes poisoned at the start of a block
+int hardened = HARDENED;
+unsigned quarantine = QUARANTINE;
+static uintptr_t harden_secret;
+
+static uintptr_t canary(header_t *header)
+{
+    return (uintptr_t)header ^ harden_secret;
+}
+
+// What hardened mode found, on stderr, and the end of the process.
+static __attribute__((noreturn, noinline, cold)) void heap_corrupt(const char *what, void *block)
+{
+    char buf[160];
+    int n = snprintf(buf, sizeof buf, "memalloc: %s, block %p\n", what, block);
+    if (write(STDERR_FILENO, buf, n < (int)sizeof buf ? n : (int)sizeof buf - 1) < 0)
+        abort();
+    abort();
+}
+
+// The secret comes from the kernel; should that fail, from addresses and the clock, which is still unknown to a
+// program that overflows a buffer by accident.
+static void harden_init(void)
+{
+    struct timespec ts;
+    if (getrandom(&harden_secret, sizeof harden_secret, GRND_NONBLOCK) == sizeof harden_secret && harden_secret)
+        return;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    harden_secret = ((uintptr_t)&ts ^ (uintptr_t)ts.tv_nsec << 20 ^ (uintptr_t)ts.tv_sec) | 1;
+}
+
+// Called for every header that starts out, or ends up, with an in-use block in front of it.
+static void set_canary(header_t *header)
+{
+    if (hardened)
+        header->s.prev_size = canary(header);
+}
+
+// Small objects do not get a header at all. They live in slab runs: RUN_SIZE-aligned, page-sized runs cut into
+// equal slots of one size class, with a bitmap of the free slots in the run header. The run of a slot is found by
+// rounding its address down, and that is where its size comes from. All runs are carved from one address range
+// reserved up front, so telling a slot from a block with a header is a single range check. The range is committed
+// a huge page at a time, so with huge pages on, runs handed out together share one TLB entry.
+#define RUN_SIZE 4096
+#define SLAB_MAX 256
+#define SLAB_CLASSES (SLAB_MAX / ALIGNMENT)
+#define SLAB_RESERVE ((size_t)4 << 30)
+#define SLAB_COMMIT HUGE_PAGE_SIZE
+// Slots start on a cache line, so slots whose size divides a line or is made of whole lines never straddle more lines
+// than they must. With cache_align set, the other sizes are rounded up to such a size, 48 bytes to 64 and anything
+// over a line to whole lines: objects then share no line with a neighbour they did not have to, and a walk over them
+// misses less, for more memory in the classes affected (80 bytes take 128). Set with -DCACHE_ALIGN=1, or before the
+// first allocation.
+#ifndef CACHE_ALIGN
+#define CACHE_ALIGN 0
+#endif
+int cache_align = CACHE_ALIGN;
+
+struct slab_run
+{
+    struct malloc_arena *arena;
+    struct slab_run *next, *prev; // the arena's runs of this class that have free slots; the free run pool uses next only
+    unsigned short cls, nslots, nfree;
+    uint64_t bitmap[4]; // a set bit is a free slot
+};
+
+#define RUN_HEADER ALIGN_UP(sizeof(struct slab_run), CACHE_LINE)
+
+static size_t line_round(size_t size)
+{
+    if (!cache_align || size > SLAB_MAX)
+        return size;
+    if (size > CACHE_LINE)
+        return ALIGN_UP(size, CACHE_LINE);
+    return CACHE_LINE % size ? CACHE_LINE : size;
+}
+
+// A block freed by a thread that does not own its arena, waiting in the arena's remote-free queue.
+// Like in the tcache, the link lives in the dead payload.
+struct remote_block
+{
+    struct remote_block *next;
+};
+
+// What an arena knows about itself, kept up to date under its lock and copied out by the statistics calls.
+struct arena_stats
+{
+    size_t system;                    // bytes in the arena's regions
+    size_t free_bytes, free_blocks;   // in the bins
+    size_t slab_bytes, slab_used;     // in the arena's slab runs, and in the slots handed out of them
+};
+
+// Every contiguous stretch of blocks an arena owns is a region: a small header, the blocks, and a zero-sized in-use
+// "fence" header at the end so that next_block() of the last block never runs off the region.
+struct heap_region
+{
+    struct malloc_arena *arena;
+    struct heap_region *next;
+};
+
+// The heap is split into arenas, each with its own regions, bins and lock, so threads working in different arenas
+// never wait for each other. Arena 0, the main arena, grows with sbrk(); the others carve SEGMENT_SIZE-aligned mmap()-ed
+// segments up through a break of their own. A block's arena follows from its address: anything inside the program break
+// range is the main arena's, otherwise the region header at the start of the segment says whose it is.
+struct malloc_arena
+{
+    // To prevent two or more threads from concurrently accessing memory, we will put a basic locking mechanism in place.
+    // Before every action on an arena you have to acquire its lock, and once you are done you have to release the lock.
+    pthread_mutex_t lock;
+    // Now we got the list of regions, and the fence of the one at the break, whose prev_size finds the last block
+    struct heap_region *regions;
+    header_t *fence;
+    header_t *bins[NBINS];
+    uint64_t binmap[NBINS / 64];
+    header_t *rover; // next-fit: the free block after the one the last search took, NULL for the head of the bin
+    struct slab_run *slab_runs[SLAB_CLASSES];
+    char *brk, *brk_end; // break and end of the current segment, the main arena uses the real program break instead
+    char *dirty_end;     // memory between the break and here was given back but may still hold old data
+    header_t *decay_head, *decay_tail;
+    // Lock-free stack of blocks freed from other threads: any thread pushes with a CAS, the arena drains it under its lock.
+    _Atomic(struct remote_block *) remote_free;
+    atomic_uint threads; // threads that were handed the arena and have not exited, see arena_join()
+    struct arena_stats stats;
+} __attribute__((aligned(CACHE_LINE))); // so that no two arenas, and no two of their locks, share a line
+
+#define MAX_ARENAS 64
+#ifndef ARENAS_PER_CPU
+#define ARENAS_PER_CPU 4
+#endif
+// How many arenas to set up, at most MAX_ARENAS; 0 makes it ARENAS_PER_CPU per online CPU.
+unsigned arena_count;
+// Non-main arenas reserve address space in segments of this size; pages only count once they are touched.
+#define SEGMENT_SIZE ((size_t)64 << 20)
+
+static struct malloc_arena arenas[MAX_ARENAS];
+#define main_arena (&arenas[0])
+static atomic_uint narenas;
+static atomic_uint next_arena;
+static __thread struct malloc_arena *thread_arena __attribute__((tls_model("initial-exec")));
+// The arena the thread is counted in, which stays the one it was handed when contention moves it to another.
+static __thread struct malloc_arena *counted_arena __attribute__((tls_model("initial-exec")));
+static __thread int thread_exited __attribute__((tls_model("initial-exec")));
+// The global lock now only guards setting up the arena table.
+pthread_mutex_t global_malloc_lock = PTHREAD_MUTEX_INITIALIZER;
+static size_t page_size;
+static char *main_heap_start;
+static atomic_uintptr_t main_heap_end;
+
+// On machines with more than one NUMA node, arena i belongs to node i % numa_nodes. Its segments, and for node 0 the
+// sbrk() heap, are mbind()-ed to prefer that node, threads are handed arenas of the node they run on, and free() sends a
+// block of another node back to its arena instead of keeping it in the tcache of a thread that would reuse it remotely.
+// Set at build time with -DNUMA=0, or clear numa before the first allocation; on a single node nothing changes.
+#ifndef NUMA
+#define NUMA 1
+#endif
+#define NUMA_MAX_NODES 64
+int numa = NUMA;
+static unsigned numa_nodes = 1;
+
+// The number of nodes is the highest one listed in sysfs plus one; read without stdio, which would allocate.
+static void numa_init(void)
+{
+    char buf[256];
+    unsigned node = 0, max = 0;
+    ssize_t i, len;
+    int fd = open("/sys/devices/system/node/online", O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return;
+    len = read(fd, buf, sizeof buf);
+    close(fd);
+    for (i = 0; i < len; i++)
+    {
+        if (buf[i] >= '0' && buf[i] <= '9')
+            node = node * 10 + buf[i] - '0';
+        else
+        {
+            max = node > max ? node : max;
+            node = 0;
+        }
+    }
+    max = node > max ? node : max;
+    numa_nodes = max < NUMA_MAX_NODES ? max + 1 : NUMA_MAX_NODES;
+}
+
+static unsigned numa_current_node(void)
+{
+    unsigned cpu, node;
+    if (getcpu(&cpu, &node))
+        return 0;
+    return node % numa_nodes;
+}
+
+static unsigned arena_node(struct malloc_arena *a)
+{
+    return (a - arenas) % numa_nodes;
+}
+
+// Pages of [start, start + len) faulted in from now on come from the node if it has any left; start is page aligned.
+// Pages already there stay where they are.
+static void numa_bind(void *start, size_t len, unsigned node)
+{
+    unsigned long mask = 1ul << node;
+    int saved = errno;
+    if (numa_nodes > 1 && len)
+        syscall(SYS_mbind, start, len, MPOL_PREFERRED, &mask, NUMA_MAX_NODES + 1, 0);
+    errno = saved;
+}
+
+// Counters a thread keeps about itself. Only the owning thread writes them, so bumping one is a plain load and store;
+// they are atomics just so that the relaxed loads of a thread taking a snapshot are well defined.
+// Live threads are on a list for the statistics calls to sum up, exiting threads add theirs to exited_stats.
+// The list also leads a forked child to the caches of the threads that did not survive the fork.
+struct thread_stats
+{
+    _Atomic uint64_t nmalloc[NBINS], nfree[NBINS]; // by size class
+    _Atomic uint64_t tcache_hits, tcache_misses, lock_contended;
+    struct latency_hists *latency; // set under stats_lock
+    struct tcache *tcache;
+    struct thread_quarantine *quarantine;
+    struct thread_stats *next, *prev;
+};
+
+#define STAT_ADD(counter, n) \
+    atomic_store_explicit(&(counter), atomic_load_explicit(&(counter), memory_order_relaxed) + (n), memory_order_relaxed)
+
+static __thread struct thread_stats thread_stats __attribute__((tls_model("initial-exec")));
+static struct thread_stats *all_thread_stats, exited_stats;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+// Large blocks belong to no arena.
+static atomic_size_t mmap_bytes, mmap_blocks;
+
+// Bin 0 holds 16 byte blocks, bin 1 32 byte blocks, ... and bin NSMALL_BINS holds (SMALL_MAX, 2 * SMALL_MAX].
+static unsigned size_class(size_t size)
+{
+    if (size <= SMALL_MAX)
+        return size / ALIGNMENT - 1;
+    return NSMALL_BINS + (63 - __builtin_clzl(size - 1)) - SMALL_SHIFT;
+}
+
+// Latency histograms. With latency_stats set, every call of malloc(), free() and friends is timed, and so are the
+// parts of it spent waiting for an arena lock or in the OS. The histograms are log-linear, like HDR histograms: with
+// 1 << LAT_SUB_BITS buckets for every power of two, a bucket's upper bound is at most 25% above any value in it, up to
+// about 8 s. Each thread files into histograms of its own, mmapped on its first timed call.
+#ifndef LATENCY_STATS
+#define LATENCY_STATS 0
+#endif
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS 128
+int latency_stats = LATENCY_STATS;
+
+struct lat_hist
+{
+    _Atomic uint64_t count[LAT_BUCKETS];
+    _Atomic uint64_t sum, max;
+};
+
+struct latency_hists
+{
+    struct lat_hist ops[MALLOC_LAT_OPS][MALLOC_LAT_PARTS];
+    struct lat_hist classes[MALLOC_LAT_OPS][NBINS]; // whole calls, by the size class of the block
+};
+
+// What the current call has spent so far.
+struct call_timing
+{
+    uint64_t lock_ns, os_ns;
+    int slow;
+};
+
+static __thread struct call_timing call_timing __attribute__((tls_model("initial-exec")));
+static struct latency_hists exited_latency;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// 0 with latency statistics off, so that lat_os() and lat_lock() know not to count.
+static uint64_t lat_start(void)
+{
+    return latency_stats ? now_ns() : 0;
+}
+
+static void lat_os(uint64_t start)
+{
+    if (start)
+    {
+        call_timing.os_ns += now_ns() - start;
+        call_timing.slow = 1;
+    }
+}
+
+static void lat_lock(uint64_t start)
+{
+    if (start)
+        call_timing.lock_ns += now_ns() - start;
+}
+
+static unsigned lat_bucket(uint64_t ns)
+{
+    unsigned e, b;
+    if (ns < 1 << LAT_SUB_BITS)
+        return ns;
+    e = 63 - __builtin_clzll(ns);
+    b = (e - LAT_SUB_BITS + 1) << LAT_SUB_BITS | ((ns >> (e - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1));
+    return b < LAT_BUCKETS ? b : LAT_BUCKETS - 1;
+}
+
+// The largest value that goes into bucket b.
+static uint64_t lat_bucket_max(unsigned b)
+{
+    unsigned e;
+    if (b < 1 << LAT_SUB_BITS)
+        return b;
+    e = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    return ((uint64_t)((1 << LAT_SUB_BITS) | (b & ((1 << LAT_SUB_BITS) - 1))) << (e - LAT_SUB_BITS)) +
+           ((uint64_t)1 << (e - LAT_SUB_BITS)) - 1;
+}
+
+static void lat_add(struct lat_hist *h, uint64_t ns)
+{
+    STAT_ADD(h->count[lat_bucket(ns)], 1);
+    STAT_ADD(h->sum, ns);
+    if (ns > atomic_load_explicit(&h->max, memory_order_relaxed))
+        atomic_store_explicit(&h->max, ns, memory_order_relaxed);
+}
+
+static void lat_merge(struct lat_hist *to, struct lat_hist *from)
+{
+    unsigned i;
+    uint64_t max = atomic_load_explicit(&from->max, memory_order_relaxed);
+    for (i = 0; i < LAT_BUCKETS; i++)
+        STAT_ADD(to->count[i], atomic_load_explicit(&from->count[i], memory_order_relaxed));
+    STAT_ADD(to->sum, atomic_load_explicit(&from->sum, memory_order_relaxed));
+    if (max > atomic_load_explicit(&to->max, memory_order_relaxed))
+        atomic_store_explicit(&to->max, max, memory_order_relaxed);
+}
+
+// The unit pages are released in: with huge pages on, releasing less would break them up.
+static size_t purge_unit(void)
+{
+    return huge_pages ? HUGE_PAGE_SIZE : page_size;
+}
+
+// The whole pages of a free block that hold nothing but dead data, past its free links.
+static int purge_range(header_t *header, char **start, char **end)
+{
+    size_t unit = purge_unit();
+    *start = (char *)ALIGN_UP((uintptr_t)(links(header) + 1), unit);
+    *end = (char *)((uintptr_t)next_block(header) & ~(unit - 1));
+    return *start < *end;
+}
+
+static uint64_t now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+// A free block with whole pages in it goes on the arena's decay list. The list is in the order blocks were freed,
+// so the blocks that are due are always at its tail.
+static void decay_insert(struct malloc_arena *a, header_t *header)
+{
+    struct free_links *l = links(header);
+    char *start, *end;
+    if (decay_ms < 0 || !purge_range(header, &start, &end))
+        return;
+    header->s.size |= BLOCK_DIRTY;
+    l->freed = now_ms();
+    l->dirty_prev = NULL;
+    l->dirty_next = a->decay_head;
+    if (a->decay_head)
+        links(a->decay_head)->dirty_prev = header;
+    else
+        a->decay_tail = header;
+    a->decay_head = header;
+}
+
+static void decay_remove(struct malloc_arena *a, header_t *header)
+{
+    struct free_links *l = links(header);
+    header->s.size &= ~BLOCK_DIRTY;
+    if (l->dirty_prev)
+        links(l->dirty_prev)->dirty_next = l->dirty_next;
+    else
+        a->decay_head = l->dirty_next;
+    if (l->dirty_next)
+        links(l->dirty_next)->dirty_prev = l->dirty_prev;
+    else
+        a->decay_tail = l->dirty_prev;
+}
+
+// Releases the pages of every block that has been free for long enough; called with the arena lock held.
+// A purged block stays in its bin, it just no longer costs memory. If it is merged with a neighbour later on,
+// the merged block is dirty again as a whole, and releasing the pages that were clean already costs next to nothing.
+static void arena_decay(struct malloc_arena *a)
+{
+    header_t *header;
+    char *start, *end;
+    uint64_t now, t;
+    if (!a->decay_tail || decay_ms < 0)
+        return;
+    now = now_ms();
+    while ((header = a->decay_tail) && now - links(header)->freed >= (uint64_t)decay_ms)
+    {
+        decay_remove(a, header);
+        if (purge_range(header, &start, &end))
+        {
+            t = lat_start();
+            madvise(start, end - start, PURGE_ADVICE);
+            lat_os(t);
+        }
+    }
+}
+
+// Which of the free blocks that fit get_free_block() picks:
+//     PLACEMENT_FIRST_FIT  the first fit in the request's bin, or else the head of the next non-empty bin
+//     PLACEMENT_BEST_FIT   the smallest fit in the request's bin, or else the smallest block of the next non-empty bin
+//     PLACEMENT_ADDRESS    first fit, with the bins kept in address order, so the low end of the heap fills up first
+//                          and the top stays free to trim
+//     PLACEMENT_NEXT_FIT   first fit, but the search of a bin picks up after the block the last one took
+// The searches and the address-ordered insert look at no more than PLACEMENT_SCAN blocks of a bin, so best fit and
+// address order are only exact for shorter bins. Set at build time with -DPLACEMENT=..., or with placement at any time.
+#define PLACEMENT_FIRST_FIT 0
+#define PLACEMENT_BEST_FIT 1
+#define PLACEMENT_ADDRESS 2
+#define PLACEMENT_NEXT_FIT 3
+#ifndef PLACEMENT
+#define PLACEMENT PLACEMENT_FIRST_FIT
+#endif
+#define PLACEMENT_SCAN 32
+int placement = PLACEMENT;
+
+static void bin_insert(struct malloc_arena *a, header_t *header)
+{
+    unsigned idx = size_class(block_size(header)), n;
+    header_t *prev = NULL, *next = a->bins[idx];
+    decay_insert(a, header);
+    a->stats.free_bytes += block_size(header);
+    a->stats.free_blocks++;
+    if (placement == PLACEMENT_ADDRESS)
+    {
+        for (n = 0; next && next < header && n < PLACEMENT_SCAN; n++)
+        {
+            prev = next;
+            next = links(next)->next;
+        }
+    }
+    links(header)->prev = prev;
+    links(header)->next = next;
+    if (next)
+        links(next)->prev = header;
+    if (prev)
+        links(prev)->next = header;
+    else
+        a->bins[idx] = header;
+    a->binmap[idx / 64] |= (uint64_t)1 << (idx % 64);
+}
+
+static void bin_remove(struct malloc_arena *a, header_t *header)
+{
+    unsigned idx = size_class(block_size(header));
+    struct free_links *l = links(header);
+    if (header->s.size & BLOCK_DIRTY)
+        decay_remove(a, header);
+    a->stats.free_bytes -= block_size(header);
+    a->stats.free_blocks--;
+    if (l->prev)
+        links(l->prev)->next = l->next;
+    else
+        a->bins[idx] = l->next;
+    if (l->next)
+        links(l->next)->prev = l->prev;
+    if (a->rover == header)
+        a->rover = l->next;
+    if (!a->bins[idx])
+        a->binmap[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+}
+
+// Returns the first non-empty bin at or above idx, or NBINS if there is none.
+static unsigned next_bin(struct malloc_arena *a, unsigned idx)
+{
+    unsigned word = idx / 64;
+    uint64_t bits;
+    if (idx >= NBINS)
+        return NBINS;
+    bits = a->binmap[word] & (~(uint64_t)0 << (idx % 64));
+    while (!bits)
+    {
+        if (++word == NBINS / 64)
+            return NBINS;
+        bits = a->binmap[word];
+    }
+    return word * 64 + __builtin_ctzll(bits);
+}
 
 // Now our new malloc() is (after removing the old one) we can:
 
-header_t *get_free_block(size_t size)
+// The smallest block of a bin that holds size bytes, of the first PLACEMENT_SCAN. Blocks of the exact bins are all
+// the same size, so there the head will do.
+static header_t *bin_best_fit(struct malloc_arena *a, unsigned idx, size_t size)
+{
+    header_t *curr, *best = NULL;
+    unsigned n;
+    if (idx < NSMALL_BINS)
+        return a->bins[idx] && block_size(a->bins[idx]) >= size ? a->bins[idx] : NULL;
+    for (curr = a->bins[idx], n = 0; curr && n < PLACEMENT_SCAN; curr = links(curr)->next, n++)
+    {
+        if (block_size(curr) >= size && (!best || block_size(curr) < block_size(best)))
+        {
+            best = curr;
+            if (block_size(curr) == size)
+                break;
+        }
+    }
+    return best;
+}
+
+// The first fit in a bin from the rover on, wrapping around to its head.
+static header_t *bin_next_fit(struct malloc_arena *a, unsigned idx, size_t size)
+{
+    header_t *start = a->rover && size_class(block_size(a->rover)) == idx ? a->rover : a->bins[idx], *curr = start;
+    unsigned n;
+    for (n = 0; curr && n < PLACEMENT_SCAN; n++)
+    {
+        if (block_size(curr) >= size)
+        {
+            a->rover = links(curr)->next;
+            return curr;
+        }
+        if (!(curr = links(curr)->next))
+            curr = a->bins[idx];
+        if (curr == start)
+            break;
+    }
+    return NULL;
+}
+
+header_t *get_free_block(struct malloc_arena *a, size_t size)
+{
+    unsigned idx = size_class(size);
+    header_t *curr;
+    if (placement == PLACEMENT_BEST_FIT)
+    {
+        if ((curr = bin_best_fit(a, idx, size)))
+            return curr;
+        idx = next_bin(a, idx + 1);
+        return idx < NBINS ? bin_best_fit(a, idx, size) : NULL;
+    }
+    if (placement == PLACEMENT_NEXT_FIT && (curr = bin_next_fit(a, idx, size)))
+        return curr;
+    // Only the request's own bin can hold blocks that are too small (power of two bins cover a range of sizes),
+    // every block in a higher bin is big enough, so we take the head of the first non-empty one.
+    for (curr = a->bins[idx]; curr; curr = links(curr)->next)
+    {
+        if (block_size(curr) >= size)
+        {
+            return curr;
+        }
+    }
+    idx = next_bin(a, idx + 1);
+    return idx < NBINS ? a->bins[idx] : NULL;
+}
+
+// Maps size bytes of anonymous memory aligned to align, by over-mapping and cutting off the excess on both sides.
+static char *map_aligned(size_t size, size_t align, int prot, int flags)
+{
+    char *map = mmap(NULL, size + align, prot, MAP_PRIVATE | MAP_ANONYMOUS | flags, -1, 0);
+    char *start;
+    if (map == MAP_FAILED)
+        return NULL;
+    start = (char *)ALIGN_UP((uintptr_t)map, align);
+    if (start != map)
+        munmap(map, start - map);
+    if (map + align != start)
+        munmap(start + size, map + align - start);
+    return start;
+}
+
+// Only the main arena grows with sbrk(), and only as long as huge pages are off.
+static int uses_sbrk(struct malloc_arena *a)
+{
+    return a == main_arena && !huge_pages;
+}
+
+static char *arena_break(struct malloc_arena *a)
+{
+    return uses_sbrk(a) ? sbrk(0) : a->brk;
+}
+
+// Whether a fence sits right at the arena's break, so that the heap can grow or shrink in place. For the main arena the
+// break as we last left it, in main_heap_end, is checked first: only when that matches do we ask whether somebody else
+// has moved the program break since.
+static int at_break(struct malloc_arena *a, header_t *fence)
+{
+    char *end = (char *)(fence + 1);
+    if (!uses_sbrk(a))
+        return end == a->brk;
+    return (uintptr_t)end == atomic_load_explicit(&main_heap_end, memory_order_relaxed) && end == sbrk(0);
+}
+
+// A new segment for an arena of the node.
+static char *map_segment(unsigned node)
+{
+    char *segment = NULL;
+    if (huge_pages == HUGE_PAGES_HUGETLB)
+        // Not MAP_NORESERVE: without a reservation an empty pool would only show up as SIGBUS on first touch.
+        segment = map_aligned(SEGMENT_SIZE, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_HUGETLB);
+    if (!segment && (segment = map_aligned(SEGMENT_SIZE, SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_NORESERVE)) && huge_pages)
+        madvise(segment, SEGMENT_SIZE, MADV_HUGEPAGE);
+    if (segment)
+        numa_bind(segment, SEGMENT_SIZE, node);
+    return segment;
+}
+
+// The arena's sbrk(): moves its break by incr bytes and returns the old break, or (void *)-1 on failure.
+// Non-main arenas bump through SEGMENT_SIZE-aligned segments reserved with MAP_NORESERVE; when one is full the rest of it is
+// abandoned for a fresh segment, and pages given back by a negative incr are dropped with madvise(). With huge pages on,
+// only whole huge pages are dropped, so that trimming does not break them up.
+// Memory it hands out always reads as zero, like fresh pages from the OS: whole pages given back are zero once they come
+// back, only the rest of the page the break stops in keeps its old contents, and that part is cleared when it is reused.
+static void *arena_move_break(struct malloc_arena *a, intptr_t incr)
+{
+    char *old = arena_break(a), *segment, *keep, *end;
+    if (incr < 0)
+    {
+        keep = (char *)ALIGN_UP((uintptr_t)(old + incr), purge_unit());
+        end = a->dirty_end > old ? a->dirty_end : old;
+        a->dirty_end = end < keep ? end : keep;
+        if (uses_sbrk(a))
+        {
+            if (sbrk(incr) == (void *)-1)
+                return (void *)-1;
+            atomic_store_explicit(&main_heap_end, (uintptr_t)(old + incr), memory_order_relaxed);
+            return old;
+        }
+        a->brk += incr;
+        if (keep < old)
+            madvise(keep, old - keep, MADV_DONTNEED);
+        return old;
+    }
+    if (uses_sbrk(a))
+    {
+        if ((old = sbrk(incr)) == (void *)-1)
+            return old;
+        atomic_store_explicit(&main_heap_end, (uintptr_t)(old + incr), memory_order_relaxed);
+        // The page the old break is in was bound with the growth before.
+        keep = (char *)ALIGN_UP((uintptr_t)old, page_size);
+        numa_bind(keep, ALIGN_UP((uintptr_t)old + incr, page_size) - (uintptr_t)keep, 0);
+    }
+    else if (old && (size_t)incr <= (size_t)(a->brk_end - old))
+        a->brk += incr;
+    else
+    {
+        if ((size_t)incr > SEGMENT_SIZE || !(segment = map_segment(arena_node(a))))
+            return (void *)-1;
+        a->brk = segment + incr;
+        a->brk_end = segment + SEGMENT_SIZE;
+        a->dirty_end = NULL;
+        return segment;
+    }
+    if (old < a->dirty_end)
+        memset(old, 0, (old + incr < a->dirty_end ? old + incr : a->dirty_end) - old);
+    return old;
+}
+
+static void *arena_morecore(struct malloc_arena *a, intptr_t incr)
+{
+    uint64_t start = lat_start();
+    void *old = arena_move_break(a, incr);
+    lat_os(start);
+    return old;
+}
+
+// How far the arena can move its break without losing contiguity.
+static size_t arena_room(struct malloc_arena *a)
+{
+    return uses_sbrk(a) ? SIZE_MAX : (size_t)(a->brk_end - a->brk);
+}
+
+// How much heap_grow() takes on top of total_size bytes, to leave behind as the top block: 0 if that would not make a
+// block of its own, or not fit in room.
+static size_t grow_extra(struct malloc_arena *a, size_t total_size, size_t room)
+{
+    size_t chunk = a->stats.system / 4, extra;
+    if (chunk < HEAP_GROW_MIN)
+        chunk = HEAP_GROW_MIN;
+    if (chunk > HEAP_GROW_MAX)
+        chunk = HEAP_GROW_MAX;
+    if (chunk <= total_size || room <= total_size)
+        return 0;
+    extra = chunk - total_size < room - total_size ? chunk - total_size : room - total_size;
+    extra &= ~(size_t)(ALIGNMENT - 1);
+    return extra >= sizeof(header_t) + ALIGNMENT ? extra : 0;
+}
+
+// Extends the arena by count blocks of the given size laid out back to back and returns the first one, plus a free top
+// block behind them (see grow_extra()). The payload of a single block grown this way is still zero.
+// If the break is still where the last region ends, the new blocks simply take the place of its fence;
+// otherwise (a new segment, or somebody else moved the program break) a new region is started.
+// Must be called with the arena lock held.
+static header_t *heap_grow(struct malloc_arena *a, size_t size, unsigned count)
+{
+    size_t total_size, pad, extra;
+    char *brk, *mem;
+    header_t *header, *first, *top;
+    struct heap_region *region;
+    unsigned i;
+    if (size > (SIZE_MAX - sizeof(struct heap_region) - 2 * sizeof(header_t) - ALIGNMENT - HEAP_GROW_MAX) / count -
+                   sizeof(header_t))
+        return NULL;
+    total_size = (sizeof(header_t) + size) * count;
+    brk = arena_break(a);
+    if (a->fence && (char *)(a->fence + 1) == brk && total_size <= arena_room(a))
+    {
+        extra = grow_extra(a, total_size, arena_room(a));
+        if ((mem = arena_morecore(a, total_size + extra)) != brk)
+            return NULL;
+        a->stats.system += total_size + extra;
+        first = a->fence;
+        first->s.size = size | (first->s.size & PREV_FREE);
+    }
+    else
+    {
+        // The initial program break has no particular alignment, so pad it before the region header goes there.
+        pad = uses_sbrk(a) ? ALIGN_UP((uintptr_t)brk, ALIGNMENT) - (uintptr_t)brk : 0;
+        extra = grow_extra(a, total_size, uses_sbrk(a) ? SIZE_MAX : SEGMENT_SIZE - sizeof(struct heap_region) - sizeof(header_t));
+        mem = arena_morecore(a, pad + sizeof(struct heap_region) + total_size + extra + sizeof(header_t));
+        if (mem == (void *)-1)
+            return NULL;
+        a->stats.system += pad + sizeof(struct heap_region) + total_size + extra + sizeof(header_t);
+        region = (struct heap_region *)(mem + pad);
+        region->arena = a;
+        region->next = a->regions;
+        a->regions = region;
+        if (uses_sbrk(a) && !main_heap_start)
+            main_heap_start = (char *)region;
+        first = (header_t *)(region + 1);
+        first->s.prev_size = 0;
+        first->s.size = size;
+        set_canary(first);
+    }
+    header = first;
+    for (i = 1; i < count; i++)
+    {
+        header = next_block(header);
+        header->s.size = size;
+        set_canary(header);
+    }
+    a->fence = next_block(header);
+    a->fence->s.size = 0;
+    set_canary(a->fence);
+    if (extra)
+    {
+        top = a->fence;
+        top->s.size = (extra - sizeof(header_t)) | BLOCK_FREE;
+        a->fence = next_block(top);
+        a->fence->s.prev_size = block_size(top);
+        a->fence->s.size = PREV_FREE;
+        bin_insert(a, top);
+    }
+    return first;
+}
+
+// Cuts an in-use block down to size bytes if the rest is big enough to be a block of its own.
+// Returns the rest, still marked in use, for the caller to heap_free(); NULL if the block was left whole.
+static header_t *split_block(header_t *header, size_t size)
+{
+    header_t *rest;
+    if (block_size(header) < size + sizeof(header_t) + ALIGNMENT)
+        return NULL;
+    rest = (header_t *)((char *)(header + 1) + size);
+    rest->s.size = block_size(header) - size - sizeof(header_t);
+    set_canary(rest);
+    header->s.size = size | (header->s.size & FLAG_MASK);
+    return rest;
+}
+
+// Takes a free block out of its bin and marks it (and the next block's PREV_FREE) as in use.
+static void take_block(struct malloc_arena *a, header_t *header)
+{
+    bin_remove(a, header);
+    header->s.size &= ~BLOCK_FREE;
+    next_block(header)->s.size &= ~PREV_FREE;
+    set_canary(next_block(header));
+}
+
+static void heap_free(struct malloc_arena *a, header_t *header);
+
+// The part of malloc() that runs under the arena lock: reuse a free block, split off what we do not need, or grow the heap.
+// *fresh tells whether the block came from growing the heap, and so is known to be zero.
+static header_t *heap_alloc(struct malloc_arena *a, size_t size, int *fresh)
+{
+    header_t *rest;
+    header_t *header = get_free_block(a, size);
+    if (header)
+    {
+        take_block(a, header);
+        if ((rest = split_block(header, size)))
+            heap_free(a, rest);
+        *fresh = 0;
+        return header;
+    }
+    *fresh = 1;
+    return heap_grow(a, size, 1);
+}
+
+// Gives the free block at the very end of the arena back to the OS once it is bigger than trim_threshold. Free blocks are
+// always coalesced, so there is at most one; the fence's boundary tag finds it in O(1). Its first top_pad bytes stay
+// behind as the new top block, or with no top_pad the block becomes the new fence.
+static void heap_trim(struct malloc_arena *a)
+{
+    header_t *header, *fence = a->fence;
+    size_t release, keep;
+    if (!fence || !(fence->s.size & PREV_FREE) || fence->s.prev_size <= trim_threshold || !at_break(a, fence))
+        return;
+    keep = ALIGN_UP(top_pad, ALIGNMENT);
+    if (keep >= fence->s.prev_size)
+        return;
+    header = prev_block(fence);
+    bin_remove(a, header);
+    if (keep)
+    {
+        release = fence->s.prev_size - keep;
+        header->s.size = keep | BLOCK_FREE;
+        a->fence = next_block(header);
+        a->fence->s.prev_size = keep;
+        a->fence->s.size = PREV_FREE;
+        bin_insert(a, header);
+    }
+    else
+    {
+        release = sizeof(header_t) + fence->s.prev_size;
+        header->s.size = 0;
+        a->fence = header;
+    }
+    arena_morecore(a, -(intptr_t)release);
+    a->stats.system -= release;
+}
+
+// The part of free() that runs under the arena lock.
+// Free neighbours are coalesced first, so there are never two free blocks next to each other.
+static void heap_free(struct malloc_arena *a, header_t *header)
+{
+    header_t *next = next_block(header), *prev;
+    size_t size = block_size(header);
+
+    if (next->s.size & BLOCK_FREE)
+    {
+        bin_remove(a, next);
+        size += sizeof(header_t) + block_size(next);
+        next = next_block(next);
+    }
+    if (header->s.size & PREV_FREE)
+    {
+        prev = prev_block(header);
+        bin_remove(a, prev);
+        size += sizeof(header_t) + block_size(prev);
+        header = prev;
+    }
+
+    header->s.size = size | BLOCK_FREE;
+    next->s.prev_size = size;
+    next->s.size |= PREV_FREE;
+    bin_insert(a, header);
+    if (next == a->fence)
+        heap_trim(a);
+    arena_decay(a);
+}
+
+// A large block is a private anonymous mapping of its own, rounded up to whole pages; the slack at the end is part of the block.
+// It is never on the block list or in a bin, so no lock is needed.
+
+// mmap() may be called before the arenas are set up, so the page size is looked up lazily.
+static size_t os_page_size(void)
+{
+    if (!page_size)
+        page_size = sysconf(_SC_PAGESIZE);
+    return page_size;
+}
+
+// Rounds a block size up so that header plus block fill whole pages, or returns 0 on overflow.
+static size_t mmap_length(size_t size)
+{
+    if (size > SIZE_MAX - sizeof(header_t) - os_page_size())
+        return 0;
+    return ALIGN_UP(sizeof(header_t) + size, page_size);
+}
+
+// Maps a block of at least size bytes whose payload is aligned to align. The header sits prev_size bytes into the mapping:
+// that is zero for the usual 16 byte alignment, otherwise the mapping is made big enough to place the payload and the
+// whole pages in front of and behind the block are unmapped again. In hardened mode a PROT_NONE guard page follows the
+// block's last page; it is part of the mapping, but not of the block.
+static header_t *mmap_alloc(size_t size, size_t align)
+{
+    size_t total_size, lead, guard = hardened ? os_page_size() : 0;
+    char *map, *block, *end;
+    header_t *header;
+    uint64_t start;
+    if (size > SIZE_MAX - align || !(total_size = mmap_length(align > ALIGNMENT ? size + align : size)) ||
+        total_size > SIZE_MAX - guard)
+        return NULL;
+    total_size += guard;
+    start = lat_start();
+    map = mmap(NULL, total_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED)
+    {
+        lat_os(start);
+        return NULL;
+    }
+    block = (char *)ALIGN_UP((uintptr_t)map + sizeof(header_t), align);
+    header = (header_t *)block - 1;
+    lead = (size_t)((char *)header - map) & ~(page_size - 1);
+    end = map + ALIGN_UP((size_t)(block + size - map), page_size);
+    if (lead)
+        munmap(map, lead);
+    if (end + guard != map + total_size)
+        munmap(end + guard, map + total_size - end - guard);
+    if (guard)
+        mprotect(end, guard, PROT_NONE);
+    lat_os(start);
+    header->s.prev_size = (char *)header - map - lead;
+    header->s.size = (end - block) | BLOCK_MMAPPED;
+    atomic_fetch_add_explicit(&mmap_bytes, end - (char *)header, memory_order_relaxed);
+    atomic_fetch_add_explicit(&mmap_blocks, 1, memory_order_relaxed);
+    return header;
+}
+
+static void mmap_free(header_t *header)
+{
+    uint64_t start = lat_start();
+    atomic_fetch_sub_explicit(&mmap_bytes, sizeof(header_t) + block_size(header), memory_order_relaxed);
+    atomic_fetch_sub_explicit(&mmap_blocks, 1, memory_order_relaxed);
+    munmap((char *)header - header->s.prev_size,
+           header->s.prev_size + sizeof(header_t) + block_size(header) + (hardened ? page_size : 0));
+    lat_os(start);
+}
+
+static char *slab_base, *slab_top, *slab_committed, *slab_end;
+// Completely free runs, one pool per node: a run's pages stay on the node that first touched them, so an arena only
+// reuses runs of its own node.
+static struct slab_run *free_runs[NUMA_MAX_NODES];
+// Guards the reserve and the pools, which any arena of the node can take from.
+static pthread_mutex_t slab_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The reserve is PROT_NONE until runs are needed and then made usable SLAB_COMMIT bytes at a time.
+// Without it (say under a tight RLIMIT_AS) small objects simply stay in the heap.
+static void slab_reserve(void)
+{
+    char *reserve = map_aligned(SLAB_RESERVE, SLAB_COMMIT, PROT_NONE, MAP_NORESERVE);
+    if (!reserve)
+        return;
+    slab_base = slab_top = slab_committed = reserve;
+    slab_end = reserve + SLAB_RESERVE;
+}
+
+static int is_slab(void *block)
+{
+    return (uintptr_t)block - (uintptr_t)slab_base < (uintptr_t)slab_end - (uintptr_t)slab_base;
+}
+
+static struct slab_run *slab_of(void *block)
+{
+    return (struct slab_run *)((uintptr_t)block & ~(uintptr_t)(RUN_SIZE - 1));
+}
+
+static size_t slot_size(struct slab_run *run)
+{
+    return (run->cls + 1) * ALIGNMENT;
+}
+
+static void run_link(struct malloc_arena *a, struct slab_run *run)
+{
+    run->prev = NULL;
+    run->next = a->slab_runs[run->cls];
+    if (run->next)
+        run->next->prev = run;
+    a->slab_runs[run->cls] = run;
+}
+
+static void run_unlink(struct malloc_arena *a, struct slab_run *run)
+{
+    if (run->prev)
+        run->prev->next = run->next;
+    else
+        a->slab_runs[run->cls] = run->next;
+    if (run->next)
+        run->next->prev = run->prev;
+}
+
+// Takes a run from the node's free run pool, or a fresh one from the reserve; NULL once the reserve is used up.
+static struct slab_run *run_get(unsigned node)
+{
+    struct slab_run *run = NULL;
+    uint64_t start;
+    pthread_mutex_lock(&slab_lock);
+    if ((run = free_runs[node]))
+    {
+        free_runs[node] = run->next;
+    }
+    else if (slab_top < slab_end)
+    {
+        start = slab_top == slab_committed ? lat_start() : 0;
+        if (slab_top < slab_committed || !mprotect(slab_committed, SLAB_COMMIT, PROT_READ | PROT_WRITE))
+        {
+            if (slab_top == slab_committed)
+            {
+                if (huge_pages)
+                    madvise(slab_committed, SLAB_COMMIT, MADV_HUGEPAGE);
+                slab_committed += SLAB_COMMIT;
+            }
+            run = (struct slab_run *)slab_top;
+            slab_top += RUN_SIZE;
+        }
+        lat_os(start);
+    }
+    pthread_mutex_unlock(&slab_lock);
+    return run;
+}
+
+static void run_put(struct slab_run *run)
+{
+    unsigned node = arena_node(run->arena);
+    pthread_mutex_lock(&slab_lock);
+    run->next = free_runs[node];
+    free_runs[node] = run;
+    pthread_mutex_unlock(&slab_lock);
+}
+
+// Sets up a run of class cls for the arena; called with the arena lock held.
+static struct slab_run *run_init(struct malloc_arena *a, unsigned cls)
+{
+    struct slab_run *run = run_get(arena_node(a));
+    unsigned i;
+    if (!run)
+        return NULL;
+    run->arena = a;
+    run->cls = cls;
+    a->stats.slab_bytes += RUN_SIZE;
+    run->nslots = run->nfree = (RUN_SIZE - RUN_HEADER) / slot_size(run);
+    for (i = 0; i < 4; i++)
+    {
+        if (run->nslots >= (i + 1) * 64)
+            run->bitmap[i] = ~(uint64_t)0;
+        else if (run->nslots > i * 64)
+            run->bitmap[i] = ((uint64_t)1 << (run->nslots - i * 64)) - 1;
+        else
+            run->bitmap[i] = 0;
+    }
+    run_link(a, run);
+    return run;
+}
+
+static void *slab_alloc(struct malloc_arena *a, unsigned cls)
+{
+    struct slab_run *run = a->slab_runs[cls];
+    unsigned w, i;
+    if (!run && !(run = run_init(a, cls)))
+        return NULL;
+    for (w = 0; !run->bitmap[w]; w++)
+        ;
+    i = w * 64 + __builtin_ctzll(run->bitmap[w]);
+    run->bitmap[w] &= run->bitmap[w] - 1;
+    a->stats.slab_used += slot_size(run);
+    if (!--run->nfree)
+        run_unlink(a, run);
+    return (char *)run + RUN_HEADER + i * slot_size(run);
+}
+
+// A run that becomes completely free goes back to the pool, unless it is the arena's only run of its class:
+// keeping one around avoids bouncing a run in and out when a single object is allocated and freed in a loop.
+static unsigned slot_index(struct slab_run *run, void *block)
+{
+    return ((char *)block - (char *)run - RUN_HEADER) / slot_size(run);
+}
+
+// Whether a slot is marked free in its run.
+static int slot_free(void *block)
+{
+    struct slab_run *run = slab_of(block);
+    unsigned i = slot_index(run, block);
+    return run->bitmap[i / 64] >> (i % 64) & 1;
+}
+
+static void slab_free(struct malloc_arena *a, void *block)
+{
+    struct slab_run *run = slab_of(block);
+    unsigned i = slot_index(run, block);
+    run->bitmap[i / 64] |= (uint64_t)1 << (i % 64);
+    a->stats.slab_used -= slot_size(run);
+    if (!run->nfree++)
+        run_link(a, run);
+    else if (run->nfree == run->nslots && (a->slab_runs[run->cls] != run || run->next))
+    {
+        run_unlink(a, run);
+        a->stats.slab_bytes -= RUN_SIZE;
+        run_put(run);
+    }
+}
+
+// The arena a pointer belongs to, for slots and blocks with a header alike.
+static struct malloc_arena *block_arena(void *block)
+{
+    uintptr_t addr = (uintptr_t)block;
+    if (is_slab(block))
+        return slab_of(block)->arena;
+    if (addr >= (uintptr_t)main_heap_start && addr < atomic_load_explicit(&main_heap_end, memory_order_relaxed))
+        return main_arena;
+    return ((struct heap_region *)(addr & ~(SEGMENT_SIZE - 1)))->arena;
+}
+
+// Whether a block belongs to another node than the calling thread's arena. free() then hands it back to its arena
+// rather than keep it in the tcache, where this thread would reuse remote memory.
+static int numa_foreign(void *block)
+{
+    return numa_nodes > 1 && thread_arena && arena_node(block_arena(block)) != arena_node(thread_arena);
+}
+
+// Frees a slot or a heap block into its arena; called with the arena lock held.
+// Hardened mode checks once more: a block freed twice through remote-free queues is only seen here.
+static void release_block(struct malloc_arena *a, void *block)
+{
+    if (hardened && (is_slab(block) ? slot_free(block) : !!(((header_t *)block - 1)->s.size & BLOCK_FREE)))
+        heap_corrupt("double free", block);
+    if (is_slab(block))
+        slab_free(a, block);
+    else
+        heap_free(a, (header_t *)block - 1);
+}
+
+// Frees a block of an arena the calling thread is not using: one CAS and no lock.
+// Popping everything at once with an exchange in drain_remote_frees() means there is no ABA problem to worry about.
+// Returns whether the arena has no thread left to drain the queue, and so the caller has to (see orphan_drain()).
+// The push and the load of the count are sequentially consistent, against the decrement in arena_leave(): either
+// the last thread leaving sees the block, or the caller sees that thread gone.
+static int remote_push(struct malloc_arena *a, void *block)
+{
+    struct remote_block *r = block;
+    struct remote_block *top = atomic_load_explicit(&a->remote_free, memory_order_relaxed);
+    do
+        r->next = top;
+    while (!atomic_compare_exchange_weak_explicit(&a->remote_free, &top, r, memory_order_seq_cst, memory_order_relaxed));
+    return !atomic_load(&a->threads);
+}
+
+// Frees everything other threads pushed on the arena's queue in one batch; called with the arena lock held.
+static void drain_remote_frees(struct malloc_arena *a)
+{
+    struct remote_block *r, *next;
+    if (!atomic_load_explicit(&a->remote_free, memory_order_relaxed))
+        return;
+    for (r = atomic_exchange_explicit(&a->remote_free, NULL, memory_order_acquire); r; r = next)
+    {
+        next = r->next;
+        release_block(a, r);
+    }
+}
+
+// An arena whose threads have all exited is drained by whoever frees into it; called without any arena lock held, as
+// two callers, each holding its own arena, could otherwise wait for each other's.
+static void orphan_drain(struct malloc_arena *a)
+{
+    pthread_mutex_lock(&a->lock);
+    drain_remote_frees(a);
+    pthread_mutex_unlock(&a->lock);
+}
+
+static void remote_free(struct malloc_arena *a, void *block)
+{
+    if (remote_push(a, block))
+        orphan_drain(a);
+}
+
+// A caller holding an arena lock collects the orphans it pushed to in a mask, and drains them once it let go.
+static void orphans_drain(uint64_t orphans)
+{
+    for (; orphans; orphans &= orphans - 1)
+        orphan_drain(&arenas[__builtin_ctzll(orphans)]);
+}
+
+// Threads count in the arena they are handed, until they exit. Most frees into an arena come from its own threads,
+// and it drains its queue whenever one of them takes the lock; once the last one is gone nobody would, so that one
+// drains it on the way out and from then on every remote_free() drains it again.
+static void arena_leave(struct malloc_arena *a)
+{
+    if (atomic_fetch_sub(&a->threads, 1) == 1)
+        orphan_drain(a);
+}
+
+static void arena_join(struct malloc_arena *a)
+{
+    if (thread_exited || counted_arena == a)
+        return;
+    atomic_fetch_add(&a->threads, 1);
+    if (counted_arena)
+        arena_leave(counted_arena);
+    counted_arena = a;
+}
+
+// The background thread wakes up a few times per decay period and decays every arena, so pages are released even
+// when nothing calls into the allocator any more. It drains the remote-free queues on the way, for arenas whose
+// threads sit idle.
+#define DECAY_INTERVAL_MIN_MS 10
+
+static void prof_poll(void);
+static void prof_init(void);
+static void conf_init(void);
+
+static void *decay_main(void *unused)
+{
+    struct malloc_arena *a;
+    struct timespec ts;
+    long interval;
+    (void)unused;
+    for (;;)
+    {
+        interval = decay_ms < 0 ? 1000 : decay_ms / 8;
+        if (interval < DECAY_INTERVAL_MIN_MS)
+            interval = DECAY_INTERVAL_MIN_MS;
+        ts.tv_sec = interval / 1000;
+        ts.tv_nsec = interval % 1000 * 1000000;
+        nanosleep(&ts, NULL);
+        for (a = arenas; a < arenas + atomic_load(&narenas); a++)
+        {
+            pthread_mutex_lock(&a->lock);
+            drain_remote_frees(a);
+            arena_decay(a);
+            pthread_mutex_unlock(&a->lock);
+        }
+        prof_poll();
+    }
+    return NULL;
+}
+
+static void malloc_prefork(void);
+static void malloc_postfork_parent(void);
+static void malloc_postfork_child(void);
+
+static void init_arenas(void)
+{
+    long cpus;
+    unsigned i, n;
+    int first = 0;
+    pthread_t thread;
+    conf_init();
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    n = arena_count ? arena_count : cpus > 0 ? cpus * ARENAS_PER_CPU : 1;
+    pthread_mutex_lock(&global_malloc_lock);
+    if (!atomic_load(&narenas))
+    {
+        if (numa)
+            numa_init();
+        if (hardened)
+            harden_init();
+        // Every node gets at least one arena.
+        n = n < numa_nodes ? numa_nodes : n > MAX_ARENAS ? MAX_ARENAS : n;
+        os_page_size();
+        slab_reserve();
+        for (i = 0; i < n; i++)
+            pthread_mutex_init(&arenas[i].lock, NULL);
+        atomic_store(&narenas, n);
+        first = 1;
+    }
+    pthread_mutex_unlock(&global_malloc_lock);
+    // Not under the lock either: pthread_atfork() may allocate.
+    if (first)
+        pthread_atfork(malloc_prefork, malloc_postfork_parent, malloc_postfork_child);
+    if (first)
+        prof_init();
+    // Only now: pthread_create() allocates, and that must find the arenas ready.
+    if (first && decay_thread && !pthread_create(&thread, NULL, decay_main, NULL))
+        pthread_detach(thread);
+}
+
+// A thread's arena: round-robin over all of them, or over those of the node the thread runs on.
+static struct malloc_arena *pick_arena(void)
+{
+    unsigned n = atomic_load(&narenas), k = atomic_fetch_add(&next_arena, 1), node;
+    if (numa_nodes == 1)
+        return &arenas[k % n];
+    node = numa_current_node();
+    return &arenas[node + k % ((n - node + numa_nodes - 1) / numa_nodes) * numa_nodes];
+}
+
+// Locks the calling thread's arena and returns it. Threads are handed arenas on first use, and again after moving
+// to another NUMA node. If the thread's arena is busy we try the others of its node before waiting, and the thread
+// stays on whichever one it got.
+static struct malloc_arena *lock_arena(void)
+{
+    struct malloc_arena *a = thread_arena, *b;
+    unsigned i, n;
+    uint64_t start;
+    if (!a || (numa_nodes > 1 && arena_node(a) != numa_current_node()))
+    {
+        if (!atomic_load(&narenas))
+            init_arenas();
+        a = thread_arena = pick_arena();
+        arena_join(a);
+    }
+    call_timing.slow = 1;
+    if (!pthread_mutex_trylock(&a->lock))
+        return a;
+    STAT_ADD(thread_stats.lock_contended, 1);
+    start = lat_start();
+    n = atomic_load(&narenas);
+    for (i = 1; i < n; i++)
+    {
+        b = &arenas[(a - arenas + i) % n];
+        if (arena_node(b) == arena_node(a) && !pthread_mutex_trylock(&b->lock))
+        {
+            lat_lock(start);
+            return thread_arena = b;
+        }
+    }
+    pthread_mutex_lock(&a->lock);
+    lat_lock(start);
+    return a;
+}
+
+// Locks a given arena, counting a wait for it like lock_arena() does.
+static void arena_lock(struct malloc_arena *a)
+{
+    uint64_t start;
+    call_timing.slow = 1;
+    if (!pthread_mutex_trylock(&a->lock))
+        return;
+    STAT_ADD(thread_stats.lock_contended, 1);
+    start = lat_start();
+    pthread_mutex_lock(&a->lock);
+    lat_lock(start);
+}
+
+// Every thread keeps a small cache of recently freed small blocks (a "tcache"), one LIFO list per size class.
+// Blocks in the cache still look allocated to the shared heap; the list link lives in the dead payload.
+// malloc() and free() of sizes up to tcache_max only touch the cache, and an arena lock is taken once per batch
+// of half a list when a list runs empty (refill) or reaches tcache_count blocks (flush).
+// tcache_max may be lowered from TCACHE_MAX_SIZE, and 0 turns the cache off.
+#define TCACHE_MAX_SIZE 512
+#define TCACHE_BINS (TCACHE_MAX_SIZE / ALIGNMENT)
+#ifndef TCACHE_COUNT
+#define TCACHE_COUNT 32
+#endif
+size_t tcache_max = TCACHE_MAX_SIZE;
+unsigned tcache_count = TCACHE_COUNT;
+static unsigned tcache_batch = (TCACHE_COUNT + 1) / 2;
+
+struct tcache_entry
+{
+    struct tcache_entry *next;
+    uintptr_t key; // harden_secret while the block is cached, in hardened mode
+};
+
+struct tcache
+{
+    struct tcache_entry *entries[TCACHE_BINS];
+    unsigned counts[TCACHE_BINS];
+    int state; // 0 = not set up yet, 1 = in use, 2 = thread is exiting, go straight to the heap
+};
+
+static __thread struct tcache tcache __attribute__((tls_model("initial-exec")));
+
+// Hardened mode's quarantine of freed blocks (see harden_free()).
+struct thread_quarantine
+{
+    void *blocks[QUARANTINE_MAX];
+    unsigned head, count; // the oldest block, and how many there are
+};
+
+static __thread struct thread_quarantine thread_quarantine __attribute__((tls_model("initial-exec")));
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+
+static void tcache_push(unsigned idx, void *block)
+{
+    struct tcache_entry *e = block;
+    e->next = tcache.entries[idx];
+    if (hardened)
+        e->key = harden_secret;
+    tcache.entries[idx] = e;
+    tcache.counts[idx]++;
+}
+
+static void *tcache_pop(unsigned idx)
+{
+    struct tcache_entry *e = tcache.entries[idx];
+    if (e)
+    {
+        tcache.entries[idx] = e->next;
+        // The next pop of the class reads the link in that block, and its caller will write to it.
+        __builtin_prefetch(e->next, 1);
+        if (hardened)
+            e->key = 0;
+        tcache.counts[idx]--;
+    }
+    return e;
+}
+
+// Hands up to n cached blocks of a class back to their arenas: blocks of the thread's own arena under a single
+// lock acquisition, blocks of other arenas through their remote-free queues.
+static void tcache_flush(unsigned idx, unsigned n)
+{
+    struct malloc_arena *a = NULL, *owner;
+    uint64_t orphans = 0;
+    void *block;
+    while (n-- && (block = tcache_pop(idx)))
+    {
+        owner = block_arena(block);
+        if (owner != thread_arena)
+        {
+            if (remote_push(owner, block))
+                orphans |= (uint64_t)1 << (owner - arenas);
+            continue;
+        }
+        if (!a)
+        {
+            a = thread_arena;
+            arena_lock(a);
+        }
+        release_block(a, block);
+    }
+    if (a)
+    {
+        drain_remote_frees(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+    orphans_drain(orphans);
+}
+
+// Moves a batch of blocks of exactly size bytes into the cache: slab slots for the slab classes, otherwise free
+// blocks of that size if there are any, a run split off one larger free block, or a batch carved out of a single sbrk() call.
+static void tcache_refill(unsigned idx, size_t size)
+{
+    struct malloc_arena *a = lock_arena();
+    header_t *header, *rest;
+    void *block;
+    // Read once: heap_grow() has to make exactly as many blocks as are then taken.
+    unsigned n = 0, batch = tcache_batch;
+    drain_remote_frees(a);
+    while (size <= SLAB_MAX && n < batch && (block = slab_alloc(a, idx)))
+    {
+        tcache_push(idx, block);
+        n++;
+    }
+    if (n)
+    {
+        pthread_mutex_unlock(&a->lock);
+        return;
+    }
+    while (n < batch && (header = a->bins[idx]))
+    {
+        take_block(a, header);
+        tcache_push(idx, header + 1);
+        n++;
+    }
+    if (!n && (header = get_free_block(a, size)))
+    {
+        take_block(a, header);
+        for (;;)
+        {
+            rest = split_block(header, size);
+            tcache_push(idx, header + 1);
+            if (++n == batch || !rest || block_size(rest) < size)
+                break;
+            header = rest;
+        }
+        if (rest)
+            heap_free(a, rest);
+    }
+    if (!n && (header = heap_grow(a, size, batch)))
+    {
+        for (; n < batch; n++)
+        {
+            tcache_push(idx, header + 1);
+            header = next_block(header);
+        }
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+// Puts the thread on the list of live threads, with its caches.
+static void stats_register(void)
+{
+    pthread_mutex_lock(&stats_lock);
+    thread_stats.tcache = &tcache;
+    thread_stats.quarantine = &thread_quarantine;
+    thread_stats.next = all_thread_stats;
+    if (all_thread_stats)
+        all_thread_stats->prev = &thread_stats;
+    all_thread_stats = &thread_stats;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+// A thread's counters outlive it in exited_stats. Called with stats_lock held; returns the latency histograms, for
+// the caller to unmap once the lock is dropped.
+static struct latency_hists *stats_retire(struct thread_stats *t)
+{
+    struct latency_hists *l = t->latency;
+    unsigned i, j;
+    for (i = 0; i < NBINS; i++)
+    {
+        STAT_ADD(exited_stats.nmalloc[i], t->nmalloc[i]);
+        STAT_ADD(exited_stats.nfree[i], t->nfree[i]);
+    }
+    STAT_ADD(exited_stats.tcache_hits, t->tcache_hits);
+    STAT_ADD(exited_stats.tcache_misses, t->tcache_misses);
+    STAT_ADD(exited_stats.lock_contended, t->lock_contended);
+    for (i = 0; l && i < MALLOC_LAT_OPS; i++)
+    {
+        for (j = 0; j < MALLOC_LAT_PARTS; j++)
+            lat_merge(&exited_latency.ops[i][j], &l->ops[i][j]);
+        for (j = 0; j < NBINS; j++)
+            lat_merge(&exited_latency.classes[i][j], &l->classes[i][j]);
+    }
+    t->latency = NULL;
+    if (t->prev)
+        t->prev->next = t->next;
+    else
+        all_thread_stats = t->next;
+    if (t->next)
+        t->next->prev = t->prev;
+    return l;
+}
+
+static void stats_unregister(void)
+{
+    struct latency_hists *l;
+    pthread_mutex_lock(&stats_lock);
+    l = stats_retire(&thread_stats);
+    pthread_mutex_unlock(&stats_lock);
+    if (l)
+        munmap(l, sizeof *l);
+}
+
+static void trace_thread_exit(void);
+static void quarantine_flush(void);
+
+// pthread key destructor: give everything back to the shared heap when the thread exits.
+static void tcache_destroy(void *unused)
+{
+    unsigned i;
+    (void)unused;
+    tcache.state = 2;
+    quarantine_flush();
+    for (i = 0; i < TCACHE_BINS; i++)
+        tcache_flush(i, tcache.counts[i]);
+    stats_unregister();
+    trace_thread_exit();
+    if (counted_arena)
+        arena_leave(counted_arena);
+    counted_arena = NULL;
+    thread_exited = 1;
+}
+
+static void tcache_key_init(void)
+{
+    pthread_key_create(&tcache_key, tcache_destroy);
+}
+
+static int tcache_usable(void)
+{
+    if (tcache.state == 1)
+        return 1;
+    if (tcache.state)
+        return 0;
+    // Set the state first: pthread_setspecific() may itself call malloc().
+    tcache.state = 1;
+    conf_init();
+    stats_register();
+    pthread_once(&tcache_once, tcache_key_init);
+    pthread_setspecific(tcache_key, &tcache);
+    return 1;
+}
+
+// Hardened mode's checks (see hardened). They run before free() and realloc() trust the block in any way.
+static size_t usable_size(void *block);
+
+static int quarantine_holds(void *block)
+{
+    struct thread_quarantine *q = &thread_quarantine;
+    unsigned i;
+    for (i = 0; i < q->count; i++)
+        if (q->blocks[(q->head + i) % QUARANTINE_MAX] == block)
+            return 1;
+    return 0;
+}
+
+static size_t poison_length(void *block)
+{
+    size_t size = usable_size(block);
+    return size < QUARANTINE_POISON ? size : QUARANTINE_POISON;
+}
+
+// Usable sizes are multiples of ALIGNMENT, so the poison is checked a word at a time.
+static void poison_check(void *block)
+{
+    uint64_t *p = block;
+    size_t i, n = poison_length(block) / sizeof *p;
+    for (i = 0; i < n; i++)
+        if (p[i] != 0xdfdfdfdfdfdfdfdfull)
+            heap_corrupt("write after free", block);
+}
+
+// Another thread may free or take the block in front meanwhile, which rewrites prev_size and PREV_FREE, so a canary
+// that looks wrong only counts once it is still wrong under the lock of the arena.
+static int front_canary_locked(header_t *header)
+{
+    struct malloc_arena *a = block_arena(header + 1);
+    int ok;
+    pthread_mutex_lock(&a->lock);
+    ok = (header->s.size & PREV_FREE) || header->s.prev_size == canary(header);
+    pthread_mutex_unlock(&a->lock);
+    return ok;
+}
+
+// Aborts unless block looks like something malloc() returned and nobody has freed since.
+static void harden_check(void *block)
+{
+    header_t *header = (header_t *)block - 1, *next;
+    struct slab_run *run;
+    struct tcache_entry *e;
+    size_t offset, size;
+    if ((uintptr_t)block % ALIGNMENT)
+        heap_corrupt("free() of a pointer malloc() did not return", block);
+    if (is_slab(block))
+    {
+        run = slab_of(block);
+        offset = (char *)block - (char *)run;
+        if (run->arena < arenas || run->arena >= arenas + MAX_ARENAS || run->cls >= SLAB_CLASSES || offset < RUN_HEADER ||
+            (offset - RUN_HEADER) % slot_size(run) || slot_index(run, block) >= run->nslots)
+            heap_corrupt("free() of a pointer malloc() did not return", block);
+        if (slot_free(block))
+            heap_corrupt("double free", block);
+    }
+    else if (header->s.size & BLOCK_FREE)
+        heap_corrupt("double free", block);
+    else if (header->s.size & BLOCK_MMAPPED)
+    {
+        if (header->s.prev_size >= page_size || ((uintptr_t)header - header->s.prev_size) % page_size)
+            heap_corrupt("corrupted header, overwritten from in front", block);
+    }
+    else
+    {
+        if (!(header->s.size & PREV_FREE) && header->s.prev_size != canary(header) && !front_canary_locked(header))
+            heap_corrupt("corrupted header, overwritten from in front", block);
+        next = next_block(header);
+        if ((next->s.size & PREV_FREE) || next->s.prev_size != canary(next))
+            heap_corrupt("corrupted next header, the block was written past its end", block);
+    }
+    size = usable_size(block);
+    e = block;
+    if (size <= TCACHE_MAX_SIZE && e->key == harden_secret)
+        for (e = tcache.entries[size_class(size)]; e; e = e->next)
+            if (e == block)
+                heap_corrupt("double free", block);
+    // Only a block that starts out poisoned can be in the quarantine.
+    if (*(uint64_t *)block == 0xdfdfdfdfdfdfdfdfull && quarantine_holds(block))
+        heap_corrupt("double free", block);
+}
+
+// The other half of hardened free(): checks the block and puts it in quarantine. Returns the block to actually free,
+// the one pushed out of the quarantine, or NULL if there is none yet.
+static void *harden_free(void *block)
+{
+    struct thread_quarantine *q = &thread_quarantine;
+    void *old;
+    harden_check(block);
+    // Big blocks are unmapped right away, which makes later use fault anyway.
+    if (tcache.state != 1 || !quarantine || (!is_slab(block) && (((header_t *)block - 1)->s.size & BLOCK_MMAPPED)))
+        return block;
+    memset(block, 0xdf, poison_length(block));
+    if (q->count < quarantine && q->count < QUARANTINE_MAX)
+    {
+        q->blocks[(q->head + q->count++) % QUARANTINE_MAX] = block;
+        return NULL;
+    }
+    old = q->blocks[q->head];
+    q->blocks[(q->head + q->count) % QUARANTINE_MAX] = block;
+    q->head = (q->head + 1) % QUARANTINE_MAX;
+    poison_check(old);
+    return old;
+}
+
+static void free_untraced(void *block);
+
+// Frees what is left in the quarantine when the thread exits.
+static void quarantine_flush(void)
+{
+    struct thread_quarantine *q = &thread_quarantine;
+    void *old;
+    while (q->count)
+    {
+        old = q->blocks[q->head];
+        q->head = (q->head + 1) % QUARANTINE_MAX;
+        q->count--;
+        poison_check(old);
+        free_untraced(old);
+    }
+}
+
+// Sampling heap profiler. With prof_sample_bytes set, every allocation is a point on a line of allocated bytes, and
+// the points to sample are drawn as a Poisson process with one sample per prof_sample_bytes bytes on average: each
+// thread counts down an exponentially distributed number of bytes. A sampled allocation always gets a header, so
+// BLOCK_SAMPLED can tell free() to drop it from the profile again; the stacks it was allocated from are kept in a table
+// of their own. With sampling off, malloc() pays one load and a branch.
+// Dumps are written by malloc_prof_dump(), or on prof_signal (set before the first allocation) by the next sampled
+// allocation or the decay thread, to <prof_prefix>.<pid>.<n>.heap and .collapsed.
+#ifndef PROF_SAMPLE_BYTES
+#define PROF_SAMPLE_BYTES 0
+#endif
+#ifndef PROF_SIGNAL
+#define PROF_SIGNAL 0
+#endif
+#define PROF_DEPTH 32
+#define PROF_SKIP 3 // prof_record(), sampled_malloc() or sampled_aligned_malloc(), and malloc() or the like
+#define PROF_STACKS 4096
+#define PROF_LIVE 65536
+size_t prof_sample_bytes = PROF_SAMPLE_BYTES;
+int prof_signal = PROF_SIGNAL;
+const char *prof_prefix = "memalloc";
+
+struct prof_stack
+{
+    uint64_t hash;
+    unsigned depth;
+    void *pc[PROF_DEPTH];
+    size_t live_count, live_bytes;   // sampled and not freed yet
+    size_t alloc_count, alloc_bytes; // sampled since the start
+    double live_estimate;            // live_bytes scaled back up to what the samples stand for
+};
+
+struct prof_live
+{
+    void *block; // NULL for an empty slot
+    unsigned stack;
+    size_t size;
+    double estimate;
+};
+
+struct thread_prof
+{
+    int64_t countdown; // bytes to go until the next sample
+    uint64_t rng;
+    int busy; // inside the profiler: what backtrace() and the dump allocate is not sampled
+};
+
+static __thread struct thread_prof thread_prof __attribute__((tls_model("initial-exec")));
+static struct prof_stack *prof_stacks;
+static struct prof_live *prof_live;
+static unsigned prof_nlive, prof_dumps;
+static atomic_int prof_dump_pending;
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// log2 of x >= 1 from the bits of the double: the exponent, plus a quadratic fit of the mantissa.
+// Off by less than 0.01, which only nudges the sampling rate.
+static double fast_log2(double x)
+{
+    union
+    {
+        double d;
+        uint64_t u;
+    } v = {x};
+    int e = (int)((v.u >> 52) & 0x7ff) - 1024; // the fit below is 1 + log2 of the mantissa
+    v.u = (v.u & (((uint64_t)1 << 52) - 1)) | ((uint64_t)1023 << 52);
+    return e + (-0.34484843 * v.d + 2.02466578) * v.d - 0.67487759;
+}
+
+// e^-x for x >= 0: halve x until the series converges quickly, then square back up.
+static double exp_neg(double x)
+{
+    unsigned k = 0;
+    double r;
+    if (x > 64)
+        return 0;
+    for (; x > 0.25; k++)
+        x /= 2;
+    r = 1 - x * (1 - x / 2 * (1 - x / 3 * (1 - x / 4)));
+    while (k--)
+        r *= r;
+    return r;
+}
+
+// An exponentially distributed byte count with mean prof_sample_bytes: -ln(u) * mean for a uniform u in (0, 1].
+static int64_t prof_interval(void)
+{
+    struct thread_prof *p = &thread_prof;
+    double u;
+    if (!p->rng)
+        p->rng = (uintptr_t)p ^ ((uint64_t)now_ms() << 20) ^ 0x9e3779b97f4a7c15ull;
+    p->rng ^= p->rng << 13;
+    p->rng ^= p->rng >> 7;
+    p->rng ^= p->rng << 17;
+    u = (double)((p->rng >> 38) + 1); // 26 random bits, 1 .. 2^26
+    return (int64_t)((26 - fast_log2(u)) * 0.69314718 * prof_sample_bytes) + 1;
+}
+
+// Counts size bytes off the thread's countdown; true if this allocation is to be sampled.
+static int prof_tick(size_t size)
+{
+    struct thread_prof *p = &thread_prof;
+    if ((p->countdown -= size) >= 0)
+        return 0;
+    p->countdown = prof_interval();
+    return !p->busy;
+}
+
+// The tables are mapped on the first sample and never given back; called with prof_lock held.
+static int prof_tables(void)
+{
+    void *map;
+    if (prof_stacks)
+        return 1;
+    map = mmap(NULL, PROF_STACKS * sizeof(struct prof_stack) + PROF_LIVE * sizeof(struct prof_live),
+               PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (map == MAP_FAILED)
+        return 0;
+    prof_live = map;
+    prof_stacks = (struct prof_stack *)(prof_live + PROF_LIVE);
+    return 1;
+}
+
+static unsigned prof_hash(const void *block)
+{
+    return (unsigned)(((uintptr_t)block >> 4) * 0x9e3779b97f4a7c15ull >> 40) & (PROF_LIVE - 1);
+}
+
+// Finds or adds the stack; returns PROF_STACKS if the table is full.
+static unsigned prof_stack_id(void **pc, unsigned depth)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    unsigned i, n;
+    struct prof_stack *st;
+    for (i = 0; i < depth; i++)
+        hash = (hash ^ (uintptr_t)pc[i]) * 0x100000001b3ull;
+    for (i = hash & (PROF_STACKS - 1), n = 0; n < PROF_STACKS; i = (i + 1) & (PROF_STACKS - 1), n++)
+    {
+        st = &prof_stacks[i];
+        if (!st->depth)
+        {
+            st->hash = hash;
+            st->depth = depth;
+            memcpy(st->pc, pc, depth * sizeof *pc);
+            return i;
+        }
+        if (st->hash == hash && st->depth == depth && !memcmp(st->pc, pc, depth * sizeof *pc))
+            return i;
+    }
+    return PROF_STACKS;
+}
+
+__attribute__((noinline)) static void prof_record(header_t *header, size_t size)
+{
+    void *pc[PROF_DEPTH + PROF_SKIP];
+    int depth;
+    unsigned id, i;
+    struct prof_stack *st;
+    struct prof_live *live;
+    // A sample of size bytes stands for size / P(an allocation of that size gets sampled) bytes.
+    double estimate = size / (1 - exp_neg((double)size / prof_sample_bytes));
+    thread_prof.busy = 1;
+    depth = backtrace(pc, PROF_DEPTH + PROF_SKIP) - PROF_SKIP;
+    pthread_mutex_lock(&prof_lock);
+    if (depth > 0 && prof_tables() && (id = prof_stack_id(pc + PROF_SKIP, depth)) < PROF_STACKS)
+    {
+        // Keep one slot empty so that lookups always end.
+        for (i = prof_hash(header + 1); prof_nlive < PROF_LIVE - 1 && prof_live[i].block; i = (i + 1) & (PROF_LIVE - 1))
+            ;
+        if (prof_nlive < PROF_LIVE - 1)
+        {
+            prof_nlive++;
+            live = &prof_live[i];
+            live->block = header + 1;
+            live->stack = id;
+            live->size = size;
+            live->estimate = estimate;
+            st = &prof_stacks[id];
+            st->live_count++;
+            st->live_bytes += size;
+            st->live_estimate += estimate;
+            st->alloc_count++;
+            st->alloc_bytes += size;
+            header->s.size |= BLOCK_SAMPLED;
+        }
+    }
+    pthread_mutex_unlock(&prof_lock);
+    prof_poll();
+    thread_prof.busy = 0;
+}
+
+// Takes a sampled block out of the profile. The live table uses linear probing, so the entries after the removed one
+// are moved back into the hole wherever their probe sequence allows it.
+static void prof_free(void *block)
+{
+    unsigned i, j, home;
+    struct prof_stack *st;
+    pthread_mutex_lock(&prof_lock);
+    for (i = prof_hash(block); prof_live[i].block && prof_live[i].block != block; i = (i + 1) & (PROF_LIVE - 1))
+        ;
+    if (prof_live[i].block)
+    {
+        st = &prof_stacks[prof_live[i].stack];
+        st->live_count--;
+        st->live_bytes -= prof_live[i].size;
+        st->live_estimate -= prof_live[i].estimate;
+        for (j = (i + 1) & (PROF_LIVE - 1); prof_live[j].block; j = (j + 1) & (PROF_LIVE - 1))
+        {
+            home = prof_hash(prof_live[j].block);
+            if (((j - home) & (PROF_LIVE - 1)) >= ((j - i) & (PROF_LIVE - 1)))
+            {
+                prof_live[i] = prof_live[j];
+                i = j;
+            }
+        }
+        prof_live[i].block = NULL;
+        prof_nlive--;
+    }
+    pthread_mutex_unlock(&prof_lock);
+}
+
+// Takes a block out of the profile if it is in there. realloc() does this too when a block may change size or move.
+static void prof_forget(header_t *header)
+{
+    if (header->s.size & BLOCK_SAMPLED)
+    {
+        header->s.size &= ~BLOCK_SAMPLED;
+        prof_free(header + 1);
+    }
+}
+
+// A sampled allocation always gets a header: it comes from the heap, never from a slab run or the tcache.
+__attribute__((noinline)) static void *sampled_malloc(size_t size, int *fresh)
+{
+    struct malloc_arena *a;
+    header_t *header = NULL;
+    if (size < mmap_threshold)
+    {
+        a = lock_arena();
+        drain_remote_frees(a);
+        header = heap_alloc(a, size, fresh);
+        pthread_mutex_unlock(&a->lock);
+    }
+    if (!header)
+    {
+        if (!(header = mmap_alloc(size, ALIGNMENT)))
+            return NULL;
+        *fresh = 1;
+    }
+    prof_record(header, size);
+    return header + 1;
+}
+
+// Buffered output straight to a file descriptor; stdio could allocate at the wrong moment.
+struct prof_out
+{
+    int fd;
+    size_t len;
+    char buf[4096];
+};
+
+static void prof_flush(struct prof_out *out)
+{
+    size_t done = 0;
+    ssize_t n;
+    while (done < out->len && (n = write(out->fd, out->buf + done, out->len - done)) > 0)
+        done += n;
+    out->len = 0;
+}
+
+static void prof_printf(struct prof_out *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    if (out->len > sizeof out->buf - 512)
+        prof_flush(out);
+    va_start(ap, fmt);
+    n = vsnprintf(out->buf + out->len, sizeof out->buf - out->len, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out->len += (size_t)n < sizeof out->buf - out->len ? (size_t)n : sizeof out->buf - out->len - 1;
+}
+
+// The legacy gperftools heap profile that pprof reads, samples as they are: pprof scales them up itself given the rate.
+// Called with prof_lock held.
+static void prof_write_pprof(struct prof_out *out)
+{
+    size_t live_count = 0, live_bytes = 0, alloc_count = 0, alloc_bytes = 0;
+    struct prof_stack *st;
+    unsigned i, j;
+    ssize_t n;
+    int maps;
+    for (i = 0; prof_stacks && i < PROF_STACKS; i++)
+    {
+        live_count += prof_stacks[i].live_count;
+        live_bytes += prof_stacks[i].live_bytes;
+        alloc_count += prof_stacks[i].alloc_count;
+        alloc_bytes += prof_stacks[i].alloc_bytes;
+    }
+    prof_printf(out, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n", live_count, live_bytes, alloc_count, alloc_bytes,
+                prof_sample_bytes);
+    for (i = 0; prof_stacks && i < PROF_STACKS; i++)
+    {
+        st = &prof_stacks[i];
+        if (!st->depth)
+            continue;
+        prof_printf(out, "%zu: %zu [%zu: %zu] @", st->live_count, st->live_bytes, st->alloc_count, st->alloc_bytes);
+        for (j = 0; j < st->depth; j++)
+            prof_printf(out, " %p", st->pc[j]);
+        prof_printf(out, "\n");
+    }
+    // pprof needs the mappings to symbolize the addresses.
+    prof_printf(out, "\nMAPPED_LIBRARIES:\n");
+    prof_flush(out);
+    if ((maps = open("/proc/self/maps", O_RDONLY)) < 0)
+        return;
+    while ((n = read(maps, out->buf, sizeof out->buf)) > 0)
+    {
+        out->len = n;
+        prof_flush(out);
+    }
+    close(maps);
+}
+
+// One line per stack that still holds memory, outermost frame first, weighted by the estimated live bytes:
+// the input flamegraph.pl and friends expect. Frames are named by dladdr() where it can, by address otherwise.
+static void prof_write_collapsed(struct prof_out *out)
+{
+    struct prof_stack *st;
+    Dl_info info;
+    unsigned i, j;
+    for (i = 0; prof_stacks && i < PROF_STACKS; i++)
+    {
+        st = &prof_stacks[i];
+        if (!st->live_count)
+            continue;
+        for (j = st->depth; j--;)
+        {
+            if (dladdr(st->pc[j], &info) && info.dli_sname)
+                prof_printf(out, "%s%s", info.dli_sname, j ? ";" : "");
+            else
+                prof_printf(out, "%p%s", st->pc[j], j ? ";" : "");
+        }
+        prof_printf(out, " %.0f\n", st->live_estimate);
+    }
+}
+
+int malloc_prof_dump(const char *path, int format)
+{
+    struct prof_out out;
+    int busy = thread_prof.busy;
+    if ((out.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0)
+        return -1;
+    out.len = 0;
+    thread_prof.busy = 1;
+    pthread_mutex_lock(&prof_lock);
+    if (format == MALLOC_PROF_COLLAPSED)
+        prof_write_collapsed(&out);
+    else
+        prof_write_pprof(&out);
+    pthread_mutex_unlock(&prof_lock);
+    thread_prof.busy = busy;
+    prof_flush(&out);
+    return close(out.fd);
+}
+
+// The dumps a prof_signal asked for.
+static void prof_write_dumps(void)
+{
+    char path[4096];
+    unsigned n = __atomic_fetch_add(&prof_dumps, 1, __ATOMIC_RELAXED);
+    snprintf(path, sizeof path, "%s.%d.%u.heap", prof_prefix, (int)getpid(), n);
+    malloc_prof_dump(path, MALLOC_PROF_PPROF);
+    snprintf(path, sizeof path, "%s.%d.%u.collapsed", prof_prefix, (int)getpid(), n);
+    malloc_prof_dump(path, MALLOC_PROF_COLLAPSED);
+}
+
+static void prof_poll(void)
+{
+    if (atomic_exchange(&prof_dump_pending, 0))
+        prof_write_dumps();
+}
+
+// Dumping takes locks, which a signal handler must not do, so the handler only asks for the dump.
+static void prof_handler(int sig)
+{
+    (void)sig;
+    atomic_store(&prof_dump_pending, 1);
+}
+
+static void prof_init(void)
+{
+    struct sigaction sa;
+    if (!prof_sample_bytes || !prof_signal)
+        return;
+    memset(&sa, 0, sizeof sa);
+    sa.sa_handler = prof_handler;
+    sa.sa_flags = SA_RESTART;
+    sigaction(prof_signal, &sa, NULL);
+}
+
+// Every timed entry point runs between lat_call_start() and lat_call_end(). Only threads on the statistics list file
+// anything, so nothing is lost when they exit.
+static uint64_t lat_call_start(void)
+{
+    if (!latency_stats)
+        return 0;
+    call_timing.lock_ns = call_timing.os_ns = 0;
+    call_timing.slow = 0;
+    return now_ns();
+}
+
+static __attribute__((noinline)) void lat_call_end(unsigned op, size_t size, uint64_t start)
+{
+    struct latency_hists *l = thread_stats.latency;
+    uint64_t ns = now_ns() - start;
+    void *map;
+    if (!l)
+    {
+        if (tcache.state != 1)
+            return;
+        map = mmap(NULL, sizeof *l, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (map == MAP_FAILED)
+            return;
+        pthread_mutex_lock(&stats_lock);
+        l = thread_stats.latency = map;
+        pthread_mutex_unlock(&stats_lock);
+    }
+    lat_add(&l->ops[op][call_timing.slow ? MALLOC_LAT_SLOW : MALLOC_LAT_FAST], ns);
+    if (call_timing.lock_ns)
+        lat_add(&l->ops[op][MALLOC_LAT_LOCK], call_timing.lock_ns);
+    if (call_timing.os_ns)
+        lat_add(&l->ops[op][MALLOC_LAT_OS], call_timing.os_ns);
+    if (size && size <= SIZE_MAX - ALIGNMENT)
+        lat_add(&l->classes[op][size_class(ALIGN_UP(size, ALIGNMENT))], ns);
+}
+
+// Allocation tracing. With trace_prefix set (before the first allocation), every call of malloc(), calloc(), realloc(),
+// free() and the aligned allocators appends a record to a buffer of the calling thread, and full buffers are written
+// to <trace_prefix>.<pid>.trace with a single write() each, so the threads need not agree on anything but the file.
+// The format is in memalloc.h; tools/replay runs a trace against any allocator. With tracing off, each call pays a
+// load and a branch.
+#ifndef TRACE_PREFIX
+#define TRACE_PREFIX NULL
+#endif
+#define TRACE_RECORDS 2048
+const char *trace_prefix = TRACE_PREFIX;
+
+struct thread_trace
+{
+    struct malloc_trace_record *buf;
+    unsigned n;
+    uint32_t thread;
+    int direct; // the thread is going away: write every record as it comes
+};
+
+static __thread struct thread_trace thread_trace __attribute__((tls_model("initial-exec")));
+static _Atomic uint32_t trace_threads;
+static _Atomic int trace_fd = -1;
+static pid_t trace_pid;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// Opens the trace file of this process on first use, and again in a child after fork(), so that a child does not
+// append to its parent's trace.
+static int trace_open(void)
+{
+    struct malloc_trace_header h = {MALLOC_TRACE_MAGIC, MALLOC_TRACE_VERSION, sizeof(struct malloc_trace_record)};
+    char path[4096];
+    int fd = atomic_load(&trace_fd);
+    if (fd >= 0 && trace_pid == getpid())
+        return fd;
+    pthread_mutex_lock(&trace_lock);
+    fd = atomic_load(&trace_fd);
+    if (fd < 0 || trace_pid != getpid())
+    {
+        if (fd >= 0)
+            close(fd);
+        trace_pid = getpid();
+        snprintf(path, sizeof path, "%s.%d.trace", trace_prefix, (int)trace_pid);
+        fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+        if (fd >= 0 && write(fd, &h, sizeof h) != sizeof h)
+        {
+            close(fd);
+            fd = -1;
+        }
+        atomic_store(&trace_fd, fd);
+    }
+    pthread_mutex_unlock(&trace_lock);
+    return fd;
+}
+
+// O_APPEND makes every write() land at the end of the file as a whole, so records of different threads never interleave.
+static void trace_write(const void *data, size_t len)
+{
+    int fd = trace_open();
+    if (fd >= 0 && write(fd, data, len) < 0)
+        return; // a trace with holes is still a trace, keep going
+}
+
+static void trace_flush(void)
+{
+    if (thread_trace.n)
+        trace_write(thread_trace.buf, thread_trace.n * sizeof *thread_trace.buf);
+    thread_trace.n = 0;
+}
+
+static __attribute__((noinline)) void trace_record(unsigned op, void *block, size_t size, unsigned align_log2,
+                                                   uint64_t time)
+{
+    struct malloc_trace_record r;
+    void *buf;
+    int saved_errno = errno;
+    if (!thread_trace.thread)
+        thread_trace.thread = atomic_fetch_add(&trace_threads, 1) + 1;
+    r.time_ns = time;
+    r.id = (uintptr_t)block;
+    r.size = size;
+    r.thread = thread_trace.thread;
+    r.op = op;
+    r.align_log2 = align_log2;
+    if (!thread_trace.buf && !thread_trace.direct)
+    {
+        buf = mmap(NULL, TRACE_RECORDS * sizeof r, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (buf == MAP_FAILED)
+            thread_trace.direct = 1;
+        else
+            thread_trace.buf = buf;
+    }
+    if (thread_trace.direct)
+        trace_write(&r, sizeof r);
+    else
+    {
+        thread_trace.buf[thread_trace.n++] = r;
+        if (thread_trace.n == TRACE_RECORDS)
+            trace_flush();
+    }
+    errno = saved_errno;
+}
+
+// At thread exit and at program exit. What the thread still frees after this, it writes out unbuffered.
+static void trace_thread_exit(void)
+{
+    if (!thread_trace.buf)
+        return;
+    trace_flush();
+    munmap(thread_trace.buf, TRACE_RECORDS * sizeof *thread_trace.buf);
+    thread_trace.buf = NULL;
+    thread_trace.direct = 1;
+}
+
+// Threads still running at exit lose what is in their buffers; the main thread gets to write its own.
+__attribute__((destructor)) static void trace_exit(void)
+{
+    if (trace_prefix)
+        trace_thread_exit();
+}
+
+// malloc() past the tcache. *fresh is set if the memory came straight from the OS and so is known to be zero.
+static void *arena_malloc(size_t size, int *fresh)
+{
+    struct malloc_arena *a;
+    header_t *header;
+    void *block;
+    *fresh = 1;
+    if (size >= mmap_threshold)
+    {
+        header = mmap_alloc(size, ALIGNMENT);
+        return header ? (void *)(header + 1) : NULL;
+    }
+    a = lock_arena();
+    drain_remote_frees(a);
+    *fresh = 0;
+    block = size <= SLAB_MAX ? slab_alloc(a, size_class(size)) : NULL;
+    if (!block && (header = heap_alloc(a, size, fresh)))
+        block = header + 1;
+    pthread_mutex_unlock(&a->lock);
+    // A full arena segment or a program break that will not move is not the end of the road.
+    if (!block && (header = mmap_alloc(size, ALIGNMENT)))
+    {
+        block = header + 1;
+        *fresh = 1;
+    }
+    return block;
+}
+
+// The entry points trace on top of *_untraced() bodies, which the allocator uses itself. They are inlined so that
+// PROF_SKIP still holds.
+static inline __attribute__((always_inline)) void *malloc_untraced(size_t size)
+{
+    void *block;
+    unsigned idx;
+    int fresh;
+    if (!size || size > SIZE_MAX - sizeof(header_t) - ALIGNMENT)
+        return NULL;
+    size = line_round(ALIGN_UP(size, ALIGNMENT));
+    idx = size_class(size);
+    if (prof_sample_bytes && prof_tick(size))
+    {
+        STAT_ADD(thread_stats.nmalloc[idx], 1);
+        return sampled_malloc(size, &fresh);
+    }
+    // Also for big sizes: setting up the tcache is what makes the thread's counters count.
+    if (tcache_usable() && size <= tcache_max)
+    {
+        STAT_ADD(thread_stats.nmalloc[idx], 1);
+        if (tcache.entries[idx])
+            STAT_ADD(thread_stats.tcache_hits, 1);
+        else
+        {
+            STAT_ADD(thread_stats.tcache_misses, 1);
+            tcache_refill(idx, size);
+        }
+        if ((block = tcache_pop(idx)))
+            return block;
+    }
+    else
+        STAT_ADD(thread_stats.nmalloc[idx], 1);
+    return arena_malloc(size, &fresh);
+}
+/*
+We check if the requested size is zero. If it is, then we return NULL.
+Small sizes are first served from the calling thread's tcache without taking any lock; only when that misses do we go to the shared heap below.
+For a valid size, we first acquire the lock of the thread's arena (see lock_arena()). The we call get_free_block() - it looks in the free list bins and see if there already exist a block of memory that is marked as free and can accomodate the given size. Here, we take a first-fit approach in searching the bin of the requested size class, then fall back to the first non-empty larger bin.
+
+If a sufficiently large free block is found, we will mark that block as not-free, split off whatever we do not need as a new free block, release the arena lock, and then return a pointer to that block. In such a case, the header pointer will refer to the header part of the block of memory we just found by traversing the list. Remember, we have to hide the very existence of the header to an outside party. When we do (header + 1), it points to the byte right after the end of the header. This is incidentally also the first byte of the actual memory block, the one the caller is interested in. This is cast to (void*) and returned.
+
+If we have not found a sufficiently large free block, then we have to extend the heap by calling sbrk(). The heap has to be extended by a size that fits the requested size as well a header. For that, we first compute the total size: total_size = sizeof(header_t) + size;. Now, we request the OS to increment the program break: sbrk(total_size).
+
+In the memory thus obtained from the OS, we first make space for the header. In C, there is no need to cast a void* to any other pointer type, it is always safely promoted. That’s why we don’t explicitly do: header = (header_t *)block;
+We fill this header with the requested size (not the total size) and mark it as not-free. There is no list to update: the next block is found from the address and size, and the new memory simply takes the place of the old fence at the end of the region. As explained earlier, we hide the header from the caller and hence return (void*)(header + 1). We make sure we release the arena lock as well.
+*/
+
+void *malloc(size_t size)
+{
+    uint64_t start = lat_call_start();
+    void *block = malloc_untraced(size);
+    if (start)
+        lat_call_end(MALLOC_LAT_MALLOC, size, start);
+    if (trace_prefix)
+        trace_record(MALLOC_TRACE_MALLOC, block, size, 0, now_ns());
+    return block;
+}
+
+static inline __attribute__((always_inline)) void free_untraced(void *block)
+{
+    struct malloc_arena *a;
+    header_t *header;
+    size_t size;
+    unsigned idx;
+    if (!block)
+    {
+        return;
+    }
+    if (hardened && !(block = harden_free(block)))
+        return;
+    if (is_slab(block))
+    {
+        size = slot_size(slab_of(block));
+    }
+    else
+    {
+        header = (header_t *)block - 1;
+        size = block_size(header);
+        prof_forget(header);
+        if (header->s.size & BLOCK_MMAPPED)
+        {
+            STAT_ADD(thread_stats.nfree[size_class(size)], 1);
+            mmap_free(header);
+            return;
+        }
+    }
+    idx = size_class(size);
+    STAT_ADD(thread_stats.nfree[idx], 1);
+    if (tcache_usable() && size <= tcache_max && !numa_foreign(block))
+    {
+        if (tcache.counts[idx] >= tcache_count)
+            tcache_flush(idx, tcache_batch);
+        tcache_push(idx, block);
+        return;
+    }
+    a = block_arena(block);
+    if (a != thread_arena)
+    {
+        remote_free(a, block);
+        return;
+    }
+    arena_lock(a);
+    release_block(a, block);
+    drain_remote_frees(a);
+    pthread_mutex_unlock(&a->lock);
+}
+
+/*
+Here, first we get the header of the block we want to free. All we need to do is get a pointer that is behind the block by a distance equalling the size of the header. So, we cast block to a header pointer type and move it behind by 1 unit.
+header = (header_t*)block - 1;
+
+sbrk(0) gives the current value of program break. To check if the block to be freed is at the end of the heap, we first find the end of the current block. The end can be computed as (char*)block + header->s.size. This is then compared with the program break.
+
+If it is in fact at the end, then we could shrink the size of the heap and release memory to OS. heap_trim() does that: the fence after the last block has PREV_FREE set and its prev_size says how big the free block in front of it is, so the free block itself becomes the new fence. Then the amount of memory to be released is calculated. This the sum of sizes of the header and the acutal block: sizeof(header_t) + prev_size. To release this much amount of memory, we call sbrk() with the negative of this value.
+
+Before anything else the block is merged with its neighbours if they are free, so fragmentation does not pile up as many small free blocks.
+
+Small blocks usually never get this far: free() pushes them on the thread's tcache, and heap_free() only sees them when a full cache list is flushed.
+
+A block of an arena the calling thread does not use is pushed on that arena's remote-free queue instead, and the arena frees it properly the next time one of its own threads takes the lock.
+
+Blocks that came from mmap_alloc() are simply unmapped, they never were part of the sbrk heap.
+
+In the case the block is not the last one in the heap, we simply set the BLOCK_FREE bit of its header, tell the next block about it (PREV_FREE and prev_size), and put it in the bin of its size class. The bins are what get_free_block() searches before actually calling sbrk() on a malloc().
+*/
+// The bytes a block can hold: the size of its slot, or of the block behind its header.
+static size_t usable_size(void *block)
+{
+    return is_slab(block) ? slot_size(slab_of(block)) : block_size((header_t *)block - 1);
+}
+
+size_t malloc_usable_size(void *block)
+{
+    return block ? usable_size(block) : 0;
+}
+
+// The alignment flags ask for. MALLOCX_ISOLATE makes it at least a cache line and rounds *size up to whole lines; 0 if
+// that overflows.
+static size_t flags_align(int flags, size_t *size)
+{
+    size_t align = (size_t)1 << (flags & 63);
+    if (!(flags & MALLOCX_ISOLATE))
+        return align;
+    if (*size > SIZE_MAX - CACHE_LINE)
+        return 0;
+    *size = ALIGN_UP(*size, CACHE_LINE);
+    return align > CACHE_LINE ? align : CACHE_LINE;
+}
+
+// What malloc_usable_size() will say of a block mallocx() gives for size and flags, without allocating one.
+// Slab slots and heap blocks are the size rounded up to ALIGNMENT (and see cache_align); mapped blocks end at a page
+// boundary, and the header, or the alignment that puts the block further in, comes off the first page. A heap block may
+// turn out a little bigger, when the rest of the free block it came from was too small to split off, and so may a
+// block that had to be mapped because its arena ran out: this is the least the caller gets.
+size_t nallocx(size_t size, int flags)
+{
+    size_t align = flags_align(flags, &size), lead;
+    if (!align || !size || size > SIZE_MAX - sizeof(header_t) - ALIGNMENT ||
+        (align > ALIGNMENT && size > SIZE_MAX - align - 4 * sizeof(header_t)))
+        return 0;
+    size = line_round(ALIGN_UP(size, ALIGNMENT));
+    if (align <= ALIGNMENT ? size < mmap_threshold : size + align < mmap_threshold)
+        return size;
+    lead = (align > ALIGNMENT ? align : sizeof(header_t)) % os_page_size();
+    if (size > SIZE_MAX - lead - page_size)
+        return 0;
+    return ALIGN_UP(lead + size, page_size) - lead;
+}
+
+void free(void *block)
+{
+    uint64_t start = block ? lat_call_start() : 0, traced = trace_prefix && block ? now_ns() : 0;
+    size_t size = start ? usable_size(block) : 0;
+    free_untraced(block);
+    if (start)
+        lat_call_end(MALLOC_LAT_FREE, size, start);
+    if (traced)
+        trace_record(MALLOC_TRACE_FREE, block, 0, 0, traced);
+}
+
+// Sized deallocation. A caller that knows the size saves free() reading the header of a slab slot, for the blocks the
+// tcache takes: they go straight onto the list of their class. Anything else, and any block while the profiler runs (a
+// sampled block must be dropped from the profile), takes the usual way. A small size does not make a small block:
+// realloc() shrinks a mapped block in place, so a block with a header is checked for being mapped first, and for being
+// no smaller than the class it would go into: a wrong size must not hand the next malloc() a block too small for it. A
+// slot is never smaller than the size that fits in it, since slot sizes are classes too.
+void free_sized(void *block, size_t size)
+{
+    uint64_t start, traced;
+    unsigned idx;
+    size_t rounded = line_round(ALIGN_UP(size, ALIGNMENT));
+    if (!block || !size || size > tcache_max || prof_sample_bytes || hardened || !tcache_usable() ||
+        (!is_slab(block) && ((((header_t *)block - 1)->s.size & BLOCK_MMAPPED) ||
+                             block_size((header_t *)block - 1) < rounded)) ||
+        numa_foreign(block))
+    {
+        free(block);
+        return;
+    }
+    start = lat_call_start();
+    traced = trace_prefix ? now_ns() : 0;
+    idx = size_class(rounded);
+    STAT_ADD(thread_stats.nfree[idx], 1);
+    if (tcache.counts[idx] >= tcache_count)
+        tcache_flush(idx, tcache_batch);
+    tcache_push(idx, block);
+    if (start)
+        lat_call_end(MALLOC_LAT_FREE, size, start);
+    if (traced)
+        trace_record(MALLOC_TRACE_FREE, block, 0, 0, traced);
+}
+
+// Over-aligned blocks came from aligned_malloc() and may be bigger than asked for, so only their header knows.
+void free_aligned_sized(void *block, size_t alignment, size_t size)
+{
+    if (alignment <= ALIGNMENT)
+        free_sized(block, size);
+    else
+        free(block);
+}
+
+// jemalloc's name for it; flags are what mallocx() was given.
+void sdallocx(void *block, size_t size, int flags)
+{
+    size_t align = flags_align(flags, &size);
+    free_aligned_sized(block, align, size);
+}
+
+// Batch allocation. The arena lock is taken once for the whole batch, and what no slab slot or free block of the right
+// size covers is carved as one contiguous run, out of a single free block or a single heap_grow(), so the blocks of a
+// batch tend to be neighbours. Returns how many blocks it put in ptrs.
+static size_t heap_batch(struct malloc_arena *a, size_t size, size_t n, void **ptrs)
+{
+    header_t *header, *rest;
+    void *block;
+    size_t got = 0, count, i;
+    while (size <= SLAB_MAX && got < n && (block = slab_alloc(a, size_class(size))))
+        ptrs[got++] = block;
+    while (got < n && (header = get_free_block(a, size)))
+    {
+        take_block(a, header);
+        for (;;)
+        {
+            rest = split_block(header, size);
+            ptrs[got++] = header + 1;
+            if (got == n || !rest || block_size(rest) < size)
+                break;
+            header = rest;
+        }
+        if (rest)
+            heap_free(a, rest);
+    }
+    // A run never takes more than a quarter of a segment, and is halved until it fits.
+    count = (SEGMENT_SIZE / 4) / (sizeof(header_t) + size);
+    for (count = count ? count : 1; got < n && count;)
+    {
+        if (count > n - got)
+            count = n - got;
+        if (!(header = heap_grow(a, size, count)))
+        {
+            count /= 2;
+            continue;
+        }
+        for (i = 0; i < count; i++)
+        {
+            ptrs[got++] = header + 1;
+            header = next_block(header);
+        }
+    }
+    return got;
+}
+
+size_t malloc_batch(size_t size, size_t n, void **ptrs)
+{
+    struct malloc_arena *a;
+    header_t *header;
+    void *block;
+    size_t got = 0, i;
+    unsigned idx;
+    if (!size || size > SIZE_MAX - sizeof(header_t) - ALIGNMENT)
+        return 0;
+    // Sampled blocks need a stack each; there is nothing to batch.
+    if (prof_sample_bytes)
+    {
+        while (got < n && (ptrs[got] = malloc(size)))
+            got++;
+        return got;
+    }
+    size = line_round(ALIGN_UP(size, ALIGNMENT));
+    idx = size_class(size);
+    if (tcache_usable() && size <= tcache_max)
+    {
+        while (got < n && (block = tcache_pop(idx)))
+        {
+            ptrs[got++] = block;
+            STAT_ADD(thread_stats.tcache_hits, 1);
+        }
+    }
+    if (got < n && size < mmap_threshold)
+    {
+        a = lock_arena();
+        drain_remote_frees(a);
+        got += heap_batch(a, size, n - got, ptrs + got);
+        pthread_mutex_unlock(&a->lock);
+    }
+    while (got < n && (header = mmap_alloc(size, ALIGNMENT)))
+        ptrs[got++] = header + 1;
+    STAT_ADD(thread_stats.nmalloc[idx], got);
+    for (i = 0; trace_prefix && i < got; i++)
+        trace_record(MALLOC_TRACE_MALLOC, ptrs[i], size, 0, now_ns());
+    return got;
+}
+
+// Blocks that fit in the tcache go there while there is room; the rest of the thread's own arena is released under a
+// single acquisition of its lock, blocks of other arenas go to their remote-free queues as usual.
+void free_batch(void **ptrs, size_t n)
+{
+    struct malloc_arena *a = NULL, *owner;
+    uint64_t orphans = 0;
+    header_t *header;
+    void *block;
+    size_t i, size;
+    unsigned idx;
+    int cached = tcache_usable();
+    for (i = 0; i < n; i++)
+    {
+        if (!(block = ptrs[i]))
+            continue;
+        if (trace_prefix)
+            trace_record(MALLOC_TRACE_FREE, block, 0, 0, now_ns());
+        if (hardened)
+        {
+            free_untraced(block);
+            continue;
+        }
+        if (!is_slab(block))
+        {
+            header = (header_t *)block - 1;
+            prof_forget(header);
+            if (header->s.size & BLOCK_MMAPPED)
+            {
+                STAT_ADD(thread_stats.nfree[size_class(block_size(header))], 1);
+                mmap_free(header);
+                continue;
+            }
+        }
+        size = usable_size(block);
+        idx = size_class(size);
+        STAT_ADD(thread_stats.nfree[idx], 1);
+        if (cached && size <= tcache_max && tcache.counts[idx] < tcache_count && !numa_foreign(block))
+        {
+            tcache_push(idx, block);
+            continue;
+        }
+        owner = block_arena(block);
+        if (owner != thread_arena)
+        {
+            if (remote_push(owner, block))
+                orphans |= (uint64_t)1 << (owner - arenas);
+            continue;
+        }
+        if (!a)
+        {
+            a = owner;
+            arena_lock(a);
+        }
+        release_block(a, block);
+    }
+    if (a)
+    {
+        drain_remote_frees(a);
+        pthread_mutex_unlock(&a->lock);
+    }
+    orphans_drain(orphans);
+}
+
+static inline __attribute__((always_inline)) void *calloc_untraced(size_t num, size_t nsize)
+{
+    size_t size;
+    void *block;
+    int fresh;
+    if (!num || !nsize)
+    {
+        return NULL;
+    }
+    size = num * nsize;
+    /* Check overflow */
+    if (nsize != size / num)
+    {
+        return NULL;
+    }
+    // Small blocks are cheap to clear and best served from the tcache. Bigger ones skip the cache, so we learn whether
+    // they are fresh from the OS: then they are zero already, and clearing them would only fault in every page for nothing.
+    if (size <= TCACHE_MAX_SIZE)
+    {
+        block = malloc_untraced(size);
+        fresh = 0;
+    }
+    else if (size > SIZE_MAX - sizeof(header_t) - ALIGNMENT)
+        return NULL;
+    else
+    {
+        STAT_ADD(thread_stats.nmalloc[size_class(ALIGN_UP(size, ALIGNMENT))], 1);
+        if (prof_sample_bytes && prof_tick(size))
+            block = sampled_malloc(ALIGN_UP(size, ALIGNMENT), &fresh);
+        else
+            block = arena_malloc(ALIGN_UP(size, ALIGNMENT), &fresh);
+    }
+    if (!block)
+    {
+        return NULL;
+    }
+    if (!fresh)
+        memset(block, 0, size);
+    return block;
+}
+
+void *calloc(size_t num, size_t nsize)
+{
+    uint64_t start = lat_call_start();
+    void *block = calloc_untraced(num, nsize);
+    // num * nsize only overflows when the call failed.
+    if (start)
+        lat_call_end(MALLOC_LAT_CALLOC, block ? num * nsize : 0, start);
+    if (trace_prefix)
+        trace_record(MALLOC_TRACE_CALLOC, block, num * nsize, 0, now_ns());
+    return block;
+}
+
+// Tries to resize a heap block without moving it; called with the lock of its arena held.
+// Growing absorbs a free next block and, for the tail of the heap, moves the program break; whatever is left over
+// after either growing or shrinking is split off and freed.
+static int heap_resize(struct malloc_arena *a, header_t *header, size_t size)
+{
+    header_t *next = next_block(header), *rest;
+    size_t have = block_size(header);
+    if ((next->s.size & BLOCK_FREE) && (have + sizeof(header_t) + block_size(next) >= size || next_block(next) == a->fence))
+    {
+        take_block(a, next);
+        header->s.size += sizeof(header_t) + block_size(next);
+        have = block_size(header);
+        next = next_block(header);
+    }
+    if (have < size && next == a->fence && at_break(a, next) && size - have <= arena_room(a))
+    {
+        if (arena_morecore(a, size - have) == (void *)-1)
+            return 0;
+        a->stats.system += size - have;
+        header->s.size += size - have;
+        a->fence = next_block(header);
+        a->fence->s.size = 0;
+        set_canary(a->fence);
+    }
+    if (block_size(header) < size)
+        return 0;
+    if ((rest = split_block(header, size)))
+        heap_free(a, rest);
+    return 1;
+}
+
+// mremap() can grow or shrink a mapping in place, or move it without copying the pages.
+// An aligned block keeps its offset into the mapping, even though a moved mapping need not keep the alignment.
+static header_t *mmap_resize(header_t *header, size_t size)
+{
+    size_t offset = header->s.prev_size, old_size = offset + sizeof(header_t) + block_size(header);
+    size_t total_size = size > SIZE_MAX - offset ? 0 : mmap_length(offset + size), guard = hardened ? page_size : 0;
+    char *map;
+    uint64_t start;
+    if (!total_size)
+        return NULL;
+    if (total_size == old_size)
+        return header;
+    start = lat_start();
+    // The guard page moves along: it becomes part of the block, or goes with the pages cut off, and a new one follows.
+    map = (char *)header - offset;
+    if (guard)
+        mprotect(map + old_size, guard, PROT_READ | PROT_WRITE);
+    map = mremap(map, old_size + guard, total_size + guard, MREMAP_MAYMOVE);
+    if (map == MAP_FAILED)
+    {
+        if (guard)
+            mprotect((char *)header - offset + old_size, guard, PROT_NONE);
+        lat_os(start);
+        return NULL;
+    }
+    if (guard)
+        mprotect(map + total_size, guard, PROT_NONE);
+    lat_os(start);
+    header = (header_t *)(map + offset);
+    atomic_fetch_add_explicit(&mmap_bytes, total_size - old_size, memory_order_relaxed);
+    header->s.size = (total_size - offset - sizeof(header_t)) | BLOCK_MMAPPED;
+    return header;
+}
+
+static inline __attribute__((always_inline)) void *realloc_untraced(void *block, size_t size)
+{
+    struct malloc_arena *a;
+    header_t *header;
+    size_t old_size, rounded;
+    void *ret;
+    int done;
+    if (!block || !size)
+        return malloc_untraced(size);
+    if (size > SIZE_MAX - sizeof(header_t) - ALIGNMENT)
+        return NULL;
+    // Sized like malloc() sizes it, or free_sized() would file the block in a class bigger than it is.
+    rounded = line_round(ALIGN_UP(size, ALIGNMENT));
+    if (hardened)
+        harden_check(block);
+    if (is_slab(block))
+    {
+        // A slot cannot change size, but it can stay put as long as the new size fits.
+        old_size = slot_size(slab_of(block));
+        if (old_size >= rounded)
+            return block;
+    }
+    else
+    {
+        header = (header_t *)block - 1;
+        if (header->s.size & BLOCK_MMAPPED)
+        {
+            prof_forget(header);
+            if ((ret = mmap_resize(header, size)))
+                return (header_t *)ret + 1;
+        }
+        else if (block_size(header) >= rounded && block_size(header) < rounded + sizeof(header_t) + ALIGNMENT)
+        {
+            // Not enough left over to split off, keep the block as it is.
+            return block;
+        }
+        else
+        {
+            prof_forget(header);
+            a = block_arena(block);
+            arena_lock(a);
+            done = heap_resize(a, header, rounded);
+            pthread_mutex_unlock(&a->lock);
+            if (done)
+                return block;
+        }
+        if (block_size(header) >= rounded)
+            return block;
+        old_size = block_size(header);
+    }
+    ret = malloc_untraced(size);
+    if (ret)
+    {
+        memcpy(ret, block, old_size);
+        free_untraced(block);
+    }
+    return ret;
+}
+
+void *realloc(void *block, size_t size)
+{
+    uint64_t start = lat_call_start(), traced = trace_prefix ? now_ns() : 0;
+    void *ret = realloc_untraced(block, size);
+    if (start)
+        lat_call_end(MALLOC_LAT_REALLOC, size, start);
+    if (traced)
+    {
+        trace_record(MALLOC_TRACE_REALLOC_FROM, block, 0, 0, traced);
+        trace_record(MALLOC_TRACE_REALLOC_TO, ret, size, 0, now_ns());
+    }
+    return ret;
+}
+
+// Aligned allocation takes a block with room to spare from the heap, puts the header right in front of the first aligned
+// address that leaves either no gap or a gap big enough to be a block of its own, and frees the gap and the rest
+// back into the bins. The result is an ordinary block, so free() and realloc() need not know it was aligned.
+// An over-aligned block with a header of its own, out of the heap or mapped.
+static header_t *aligned_heap_alloc(size_t align, size_t size)
+{
+    struct malloc_arena *a;
+    header_t *header, *aligned, *rest;
+    char *block;
+    size_t gap;
+    int fresh;
+    if (size + align >= mmap_threshold)
+        return mmap_alloc(size, align);
+    a = lock_arena();
+    drain_remote_frees(a);
+    // The gap in front is at most align + 16 bytes: one more align if the first aligned address is only 16 bytes in.
+    header = heap_alloc(a, size + align + sizeof(header_t), &fresh);
+    if (header)
+    {
+        block = (char *)ALIGN_UP((uintptr_t)(header + 1), align);
+        gap = block - (char *)(header + 1);
+        if (gap && gap < sizeof(header_t) + ALIGNMENT)
+        {
+            block += align;
+            gap += align;
+        }
+        aligned = (header_t *)block - 1;
+        if (gap)
+        {
+            aligned->s.size = block_size(header) - gap;
+            header->s.size = (gap - sizeof(header_t)) | (header->s.size & PREV_FREE);
+            heap_free(a, header);
+        }
+        if ((rest = split_block(aligned, size)))
+            heap_free(a, rest);
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (!header)
+        return mmap_alloc(size, align);
+    return aligned;
+}
+
+// Like sampled_malloc(), for the aligned entry points.
+__attribute__((noinline)) static void *sampled_aligned_malloc(size_t align, size_t size)
+{
+    header_t *header = aligned_heap_alloc(align, size);
+    if (!header)
+        return NULL;
+    prof_record(header, size);
+    return header + 1;
+}
+
+static inline __attribute__((always_inline)) void *aligned_malloc_untraced(size_t align, size_t size)
 {
-    header_t *curr = head;
-    while (curr)
+    header_t *header;
+    unsigned idx;
+    if (align <= ALIGNMENT)
+        return malloc_untraced(size);
+    if (!size || size > SIZE_MAX - align - 4 * sizeof(header_t))
+        return NULL;
+    size = line_round(ALIGN_UP(size, ALIGNMENT));
+    idx = size_class(size);
+    STAT_ADD(thread_stats.nmalloc[idx], 1);
+    if (prof_sample_bytes && prof_tick(size))
+        return sampled_aligned_malloc(align, size);
+    // Slots start on a cache line and follow each other at their size, so when that is a multiple of the alignment,
+    // every slot is aligned and the tcache serves the size as for malloc(). A heap block of the class may not be.
+    if (align <= CACHE_LINE && size <= SLAB_MAX && size <= tcache_max && !(size % align) && tcache_usable())
     {
-        /* code */
-        if (curr->s.is_free && curr->s.size >= size)
+        if (tcache.entries[idx])
+            STAT_ADD(thread_stats.tcache_hits, 1);
+        else
         {
-            return curr;
+            STAT_ADD(thread_stats.tcache_misses, 1);
+            tcache_refill(idx, size);
         }
-        curr = curr->s.next;
+        if (tcache.entries[idx] && !((uintptr_t)tcache.entries[idx] % align))
+            return tcache_pop(idx);
     }
-    return NULL;
+    header = aligned_heap_alloc(align, size);
+    return header ? (void *)(header + 1) : NULL;
 }
 
-void *malloc(size_t size)
+// Inlined into every aligned entry point, like the *_untraced() bodies, so that PROF_SKIP holds for them too.
+static inline __attribute__((always_inline)) void *aligned_malloc(size_t align, size_t size)
 {
-    size_t total_size;
+    uint64_t start = lat_call_start();
     void *block;
-    header_t *header;
-    if (!size)
+    // Anything below ALIGNMENT is ALIGNMENT, and memalign(0) is not a reason to pass 0 to ctzl.
+    if (align < ALIGNMENT)
+        align = ALIGNMENT;
+    block = aligned_malloc_untraced(align, size);
+    if (start)
+        lat_call_end(MALLOC_LAT_ALIGNED, size, start);
+    if (trace_prefix)
+        trace_record(MALLOC_TRACE_ALIGNED, block, size, __builtin_ctzl(align), now_ns());
+    return block;
+}
+
+int posix_memalign(void **memptr, size_t alignment, size_t size)
+{
+    void *block;
+    if (!alignment || alignment % sizeof(void *) || alignment & (alignment - 1))
+        return EINVAL;
+    block = aligned_malloc(alignment, size);
+    if (!block && size)
+        return ENOMEM;
+    *memptr = block;
+    return 0;
+}
+
+void *aligned_alloc(size_t alignment, size_t size)
+{
+    if (!alignment || alignment & (alignment - 1))
+    {
+        errno = EINVAL;
         return NULL;
-    pthread_mutex_lock(&global_malloc_lock);
-    header = get_free_block(size);
-    if (header)
+    }
+    return aligned_malloc(alignment, size);
+}
+
+// jemalloc's interface, with the log2 of the alignment in the low bits of flags. MALLOCX_ISOLATE gives the block cache
+// lines of its own.
+void *mallocx(size_t size, int flags)
+{
+    size_t align = flags_align(flags, &size);
+    if (!align)
+        return NULL;
+    return aligned_malloc(align, size);
+}
+
+// The old interface is more forgiving: an alignment that is not a power of two is rounded up to one.
+void *memalign(size_t alignment, size_t size)
+{
+    if (alignment > SIZE_MAX / 2 + 1)
+        return NULL;
+    while (alignment & (alignment - 1))
+        alignment += alignment & -alignment;
+    return aligned_malloc(alignment, size);
+}
+
+void *valloc(size_t size)
+{
+    return aligned_malloc(os_page_size(), size);
+}
+
+// Like valloc(), but the size is rounded up to whole pages too.
+void *pvalloc(size_t size)
+{
+    if (size > SIZE_MAX - os_page_size())
+        return NULL;
+    return aligned_malloc(page_size, ALIGN_UP(size ? size : 1, page_size));
+}
+
+// Regions (see memalloc.h) take their chunks straight from mmap(), like large blocks do. Chunks start at
+// REGION_CHUNK_MIN and double up to REGION_CHUNK_MAX, so even a big region is only a few of them to unmap.
+#define REGION_CHUNK_MIN ((size_t)64 << 10)
+#define REGION_CHUNK_MAX ((size_t)4 << 20)
+
+struct region_chunk
+{
+    struct region_chunk *next;
+    size_t size; // of the whole mapping, this header included
+};
+
+struct malloc_region
+{
+    struct region_chunk *chunks; // the chunk being bumped through comes first
+    char *top, *end;
+    size_t next_size;
+};
+
+static atomic_size_t region_bytes, region_chunks;
+
+static struct region_chunk *region_map(size_t size)
+{
+    struct region_chunk *c;
+    uint64_t start = lat_start();
+    c = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (c != MAP_FAILED && huge_pages && size >= HUGE_PAGE_SIZE)
+        madvise(c, size, MADV_HUGEPAGE);
+    lat_os(start);
+    if (c == MAP_FAILED)
+        return NULL;
+    c->size = size;
+    atomic_fetch_add_explicit(&region_bytes, size, memory_order_relaxed);
+    atomic_fetch_add_explicit(&region_chunks, 1, memory_order_relaxed);
+    return c;
+}
+
+static void region_unmap(struct region_chunk *c)
+{
+    atomic_fetch_sub_explicit(&region_bytes, c->size, memory_order_relaxed);
+    atomic_fetch_sub_explicit(&region_chunks, 1, memory_order_relaxed);
+    munmap(c, c->size);
+}
+
+// A block bigger than a quarter of the next chunk gets a chunk of its own. That one goes behind the current chunk, so
+// the room left in the current one is not lost.
+static __attribute__((noinline)) void *region_grow(struct malloc_region *r, size_t size)
+{
+    struct region_chunk *c;
+    size_t length;
+    if (size > r->next_size / 4)
     {
-        header->s.is_free = 0;
-        pthread_mutex_unlock(&global_malloc_lock);
-        return (void *)(header + 1);
+        if (!(length = mmap_length(size)) || !(c = region_map(length)))
+            return NULL;
+        if (r->chunks)
+        {
+            c->next = r->chunks->next;
+            r->chunks->next = c;
+        }
+        else
+        {
+            c->next = NULL;
+            r->chunks = c;
+            r->top = r->end = (char *)c + length;
+        }
+        return c + 1;
     }
-    total_size = sizeof(header_t) + size;
-    block = sbrk(total_size);
-    if (block == (void *)-1)
+    if (!(c = region_map(r->next_size)))
+        return NULL;
+    if (r->next_size < REGION_CHUNK_MAX)
+        r->next_size *= 2;
+    c->next = r->chunks;
+    r->chunks = c;
+    r->top = (char *)(c + 1) + size;
+    r->end = (char *)c + c->size;
+    return c + 1;
+}
+
+struct malloc_region *arena_create(void)
+{
+    struct malloc_region *r = malloc_untraced(sizeof *r);
+    if (r)
     {
-        pthread_mutex_unlock(&global_malloc_lock);
+        memset(r, 0, sizeof *r);
+        r->next_size = REGION_CHUNK_MIN;
+    }
+    return r;
+}
+
+void *arena_alloc(struct malloc_region *r, size_t size)
+{
+    char *block;
+    if (!size || size > SIZE_MAX - sizeof(header_t) - ALIGNMENT)
         return NULL;
+    size = ALIGN_UP(size, ALIGNMENT);
+    if (size <= (size_t)(r->end - r->top))
+    {
+        block = r->top;
+        r->top += size;
+        return block;
     }
-    header = block;
-    header->s.size = size;
-    header->s.is_free = 0;
-    header->s.next = NULL;
-    if (!head)
-        head = header;
-    if (tail)
-        tail->s.next = header;
+    return region_grow(r, size);
+}
 
-    tail = header;
-    pthread_mutex_unlock(&global_malloc_lock);
-    return (void *)(header + 1);
+void arena_reset(struct malloc_region *r)
+{
+    struct region_chunk *c, *next;
+    if (!r->chunks)
+        return;
+    for (c = r->chunks->next; c; c = next)
+    {
+        next = c->next;
+        region_unmap(c);
+    }
+    r->chunks->next = NULL;
+    r->top = (char *)(r->chunks + 1);
+    r->end = (char *)r->chunks + r->chunks->size;
+}
+
+void arena_destroy(struct malloc_region *r)
+{
+    struct region_chunk *c, *next;
+    if (!r)
+        return;
+    for (c = r->chunks; c; c = next)
+    {
+        next = c->next;
+        region_unmap(c);
+    }
+    free_untraced(r);
 }
-/*
-We check if the requested size is zero. If it is, then we return NULL.
-For a valid size, we first acquire the lock. The we call get_free_block() - it traverses the linked list and see if there already exist a block of memory that is marked as free and can accomodate the given size. Here, we take a first-fit approach in searching the linked list.
 
-If a sufficiently large free block is found, we will simply mark that block as not-free, release the global lock, and then return a pointer to that block. In such a case, the header pointer will refer to the header part of the block of memory we just found by traversing the list. Remember, we have to hide the very existence of the header to an outside party. When we do (header + 1), it points to the byte right after the end of the header. This is incidentally also the first byte of the actual memory block, the one the caller is interested in. This is cast to (void*) and returned.
+// Tuning without a rebuild. Every knob above can be set from MEMALLOC_CONF, a comma-separated list of name=value pairs
+// read by the first allocation (MEMALLOC_CONF=mmap_threshold=1m,decay_ms=0,huge_pages=thp, say), by name through
+// mallctl(), or through mallopt() for the glibc parameters. Startup options are only read when the arenas are set up,
+// so once anything has been allocated writes to them are refused; the others may change at any time.
+enum option_type
+{
+    OPT_SIZE,
+    OPT_LONG,
+    OPT_INT,
+    OPT_UINT,
+    OPT_STRING
+};
 
-If we have not found a sufficiently large free block, then we have to extend the heap by calling sbrk(). The heap has to be extended by a size that fits the requested size as well a header. For that, we first compute the total size: total_size = sizeof(header_t) + size;. Now, we request the OS to increment the program break: sbrk(total_size).
+struct malloc_option
+{
+    const char *name;
+    enum option_type type;
+    void *value;
+    long min;
+    size_t max;
+    int startup;
+    const char *const *names; // what the values 0, 1, ... may be called in MEMALLOC_CONF
+};
 
-In the memory thus obtained from the OS, we first make space for the header. In C, there is no need to cast a void* to any other pointer type, it is always safely promoted. That’s why we don’t explicitly do: header = (header_t *)block;
-We fill this header with the requested size (not the total size) and mark it as not-free. We update the next pointer, head and tail so to reflect the new state of the linked list. As explained earlier, we hide the header from the caller and hence return (void*)(header + 1). We make sure we release the global lock as well.
-*/
+static const char *const bool_names[] = {"false", "true", NULL};
+static const char *const huge_page_names[] = {"off", "thp", "hugetlb", NULL};
+static const char *const placement_names[] = {"first", "best", "address", "next", NULL};
 
-void free(void *block)
+static const struct malloc_option options[] = {
+    {"mmap_threshold", OPT_SIZE, &mmap_threshold, 0, SIZE_MAX, 0, NULL},
+    {"trim_threshold", OPT_SIZE, &trim_threshold, 0, SIZE_MAX, 0, NULL},
+    {"top_pad", OPT_SIZE, &top_pad, 0, HEAP_GROW_MAX, 0, NULL},
+    {"arenas", OPT_UINT, &arena_count, 0, MAX_ARENAS, 1, NULL},
+    {"tcache_max", OPT_SIZE, &tcache_max, 0, TCACHE_MAX_SIZE, 0, NULL},
+    {"tcache_count", OPT_UINT, &tcache_count, 1, 1024, 0, NULL},
+    {"placement", OPT_INT, &placement, 0, PLACEMENT_NEXT_FIT, 0, placement_names},
+    {"cache_align", OPT_INT, &cache_align, 0, 1, 1, bool_names},
+    {"decay_ms", OPT_LONG, &decay_ms, -1, LONG_MAX, 0, NULL},
+    {"decay_thread", OPT_INT, &decay_thread, 0, 1, 1, bool_names},
+    {"huge_pages", OPT_INT, &huge_pages, 0, HUGE_PAGES_HUGETLB, 1, huge_page_names},
+    {"numa", OPT_INT, &numa, 0, 1, 1, bool_names},
+    {"latency_stats", OPT_INT, &latency_stats, 0, 1, 1, bool_names},
+    {"prof_sample_bytes", OPT_SIZE, &prof_sample_bytes, 0, SIZE_MAX, 1, NULL},
+    {"prof_signal", OPT_INT, &prof_signal, 0, NSIG - 1, 1, NULL},
+    {"prof_prefix", OPT_STRING, &prof_prefix, 0, 0, 0, NULL},
+    {"trace_prefix", OPT_STRING, &trace_prefix, 0, 0, 1, NULL},
+    {"hardened", OPT_INT, &hardened, 0, 1, 1, bool_names},
+    {"quarantine", OPT_UINT, &quarantine, 0, QUARANTINE_MAX, 0, NULL},
+};
+
+// Serializes writers, so that tcache_count and tcache_batch change together.
+static pthread_mutex_t conf_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t conf_once = PTHREAD_ONCE_INIT;
+
+static const struct malloc_option *option_find(const char *name, size_t len)
 {
-    header_t *header, *tmp;
-    void *programbreak;
-    if (!block)
+    unsigned i;
+    for (i = 0; i < sizeof options / sizeof *options; i++)
+        if (!strncmp(options[i].name, name, len) && !options[i].name[len])
+            return &options[i];
+    return NULL;
+}
+
+static size_t option_size(const struct malloc_option *o)
+{
+    switch (o->type)
     {
-        return;
+    case OPT_SIZE:
+        return sizeof(size_t);
+    case OPT_LONG:
+        return sizeof(long);
+    case OPT_INT:
+        return sizeof(int);
+    case OPT_UINT:
+        return sizeof(unsigned);
+    default:
+        return sizeof(const char *);
     }
-    pthread_mutex_lock(&global_malloc_lock);
-    header = (header_t *)block - 1;
+}
+
+// Checks a new value, given in the option's own type, and stores it. Returns 0 or an errno value, like mallctl().
+static int option_write(const struct malloc_option *o, const void *value, size_t len)
+{
+    long n = 0;
+    if (len != option_size(o))
+        return EINVAL;
+    if (o->startup && atomic_load(&narenas))
+        return EPERM;
+    if (o->type == OPT_SIZE && *(const size_t *)value > o->max)
+        return EINVAL;
+    if (o->type == OPT_LONG)
+        n = *(const long *)value;
+    else if (o->type == OPT_INT)
+        n = *(const int *)value;
+    else if (o->type == OPT_UINT)
+        n = *(const unsigned *)value;
+    if (n < o->min || (n > 0 && (size_t)n > o->max))
+        return EINVAL;
+    memcpy(o->value, value, len);
+    if (o->value == &tcache_count)
+        tcache_batch = (tcache_count + 1) / 2;
+    return 0;
+}
 
-    programbreak = sbrk(0);
-    if ((char *)block + header->s.size == programbreak)
+static int option_write_number(const struct malloc_option *o, long n)
+{
+    size_t size = n;
+    unsigned u = n;
+    int i = n;
+    if (n < o->min || (n > 0 && (size_t)n > o->max))
+        return EINVAL;
+    switch (o->type)
     {
-        if (head == tail)
-        {
-            head = tail = NULL;
-        }
-        else
+    case OPT_SIZE:
+        return option_write(o, &size, sizeof size);
+    case OPT_LONG:
+        return option_write(o, &n, sizeof n);
+    case OPT_INT:
+        return option_write(o, &i, sizeof i);
+    case OPT_UINT:
+        return option_write(o, &u, sizeof u);
+    default:
+        return EINVAL;
+    }
+}
+
+// A value from MEMALLOC_CONF: a number, with a k, m or g suffix for sizes, one of the option's names, or the text of a
+// string, which is copied since the environment may change later. An empty string sets it to NULL.
+static int option_parse(const struct malloc_option *o, const char *text, size_t len)
+{
+    static char strings[1024];
+    static size_t strings_used;
+    const char *str = NULL;
+    char buf[32], *end;
+    unsigned i, shift;
+    size_t size;
+    long n;
+    if (o->type == OPT_STRING)
+    {
+        if (len)
         {
-            tmp = head;
-            while (tmp)
-            {
-                if (tmp->s.next == tail)
-                {
-                    tmp->s.next = NULL;
-                    tail = tmp;
-                }
-                tmp = tmp->s.next;
-            }
+            if (len >= sizeof strings - strings_used)
+                return ENOMEM;
+            str = memcpy(strings + strings_used, text, len);
+            strings[strings_used + len] = 0;
+            strings_used += len + 1;
         }
-        sbrk(0 - sizeof(header_t) - header->s.size);
-        pthread_mutex_unlock(&global_malloc_lock);
+        return option_write(o, &str, sizeof str);
+    }
+    for (i = 0; o->names && o->names[i]; i++)
+        if (!strncmp(o->names[i], text, len) && !o->names[i][len])
+            return option_write_number(o, i);
+    if (!len || len >= sizeof buf)
+        return EINVAL;
+    memcpy(buf, text, len);
+    buf[len] = 0;
+    errno = 0;
+    if (o->type == OPT_SIZE)
+    {
+        size = strtoull(buf, &end, 0);
+        shift = *end == 'k' ? 10 : *end == 'm' ? 20 : *end == 'g' ? 30 : 0;
+        end += shift != 0;
+        if (errno || end == buf || *end || buf[0] == '-' || size > SIZE_MAX >> shift)
+            return EINVAL;
+        size <<= shift;
+        return option_write(o, &size, sizeof size);
+    }
+    n = strtol(buf, &end, 0);
+    if (errno || end == buf || *end)
+        return EINVAL;
+    return option_write_number(o, n);
+}
+
+static void conf_warn(const char *entry, size_t len)
+{
+    static const char prefix[] = "memalloc: ignoring MEMALLOC_CONF entry \"";
+    char buf[256];
+    size_t n = sizeof prefix - 1;
+    memcpy(buf, prefix, n);
+    if (len > sizeof buf - n - 2)
+        len = sizeof buf - n - 2;
+    memcpy(buf + n, entry, len);
+    n += len;
+    buf[n++] = '"';
+    buf[n++] = '\n';
+    if (write(STDERR_FILENO, buf, n) < 0)
         return;
+}
+
+// Not getenv(): a set-user-ID program must not be talked into writing traces wherever its caller likes.
+static void conf_read(void)
+{
+    const char *conf = secure_getenv("MEMALLOC_CONF"), *p, *eq, *end;
+    const struct malloc_option *o;
+    int saved = errno;
+    for (p = conf; p && *p; p = *end ? end + 1 : end)
+    {
+        end = strchrnul(p, ',');
+        if (end == p)
+            continue;
+        eq = memchr(p, '=', end - p);
+        o = eq ? option_find(p, eq - p) : NULL;
+        if (!o || option_parse(o, eq + 1, end - eq - 1))
+            conf_warn(p, end - p);
+    }
+    errno = saved;
+}
+
+static void conf_init(void)
+{
+    pthread_once(&conf_once, conf_read);
+}
+
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen)
+{
+    const struct malloc_option *o = option_find(name, strlen(name));
+    size_t len;
+    int err = 0;
+    if (!o)
+        return ENOENT;
+    len = option_size(o);
+    if (oldp && (!oldlenp || *oldlenp != len))
+        return EINVAL;
+    conf_init();
+    pthread_mutex_lock(&conf_lock);
+    if (oldp)
+        memcpy(oldp, o->value, len);
+    if (oldlenp)
+        *oldlenp = len;
+    if (newp)
+        err = option_write(o, newp, newlen);
+    pthread_mutex_unlock(&conf_lock);
+    return err;
+}
+
+// The glibc parameters that have a counterpart here; returns 1 on success and 0 otherwise, like glibc.
+int mallopt(int param, int value)
+{
+    const char *name;
+    int err;
+    switch (param)
+    {
+    case M_MMAP_THRESHOLD:
+        name = "mmap_threshold";
+        break;
+    case M_TRIM_THRESHOLD:
+        name = "trim_threshold";
+        break;
+    case M_TOP_PAD:
+        name = "top_pad";
+        break;
+    case M_ARENA_MAX:
+        name = "arenas";
+        break;
+    default:
+        return 0;
     }
-    header->s.is_free = 1;
+    conf_init();
+    pthread_mutex_lock(&conf_lock);
+    err = option_write_number(option_find(name, strlen(name)), value);
+    pthread_mutex_unlock(&conf_lock);
+    return !err;
+}
+
+// fork() copies only the calling thread, so a lock another thread held at that moment would stay locked in the child
+// for good. Around fork() the handlers take every lock of the allocator, in the order they nest: the options, the
+// arena table, the arenas, the slab pool, the profile, the trace and the statistics. The child then starts over with
+// fresh locks and hands the tcaches and quarantines of the threads left behind back to their arenas, as nobody is left
+// to use or free those blocks. The decay thread is left behind too; the child only decays as its arenas are used.
+static void malloc_prefork(void)
+{
+    unsigned i, n;
+    // Or the child would write the parent's buffered records to its own trace.
+    if (trace_prefix)
+        trace_flush();
+    pthread_mutex_lock(&conf_lock);
+    pthread_mutex_lock(&global_malloc_lock);
+    n = atomic_load(&narenas);
+    for (i = 0; i < n; i++)
+        pthread_mutex_lock(&arenas[i].lock);
+    pthread_mutex_lock(&slab_lock);
+    pthread_mutex_lock(&prof_lock);
+    pthread_mutex_lock(&trace_lock);
+    pthread_mutex_lock(&stats_lock);
+}
+
+static void malloc_postfork_parent(void)
+{
+    unsigned i = atomic_load(&narenas);
+    pthread_mutex_unlock(&stats_lock);
+    pthread_mutex_unlock(&trace_lock);
+    pthread_mutex_unlock(&prof_lock);
+    pthread_mutex_unlock(&slab_lock);
+    while (i--)
+        pthread_mutex_unlock(&arenas[i].lock);
     pthread_mutex_unlock(&global_malloc_lock);
+    pthread_mutex_unlock(&conf_lock);
 }
 
-/*
-Here, first we get the header of the block we want to free. All we need to do is get a pointer that is behind the block by a distance equalling the size of the header. So, we cast block to a header pointer type and move it behind by 1 unit.
-header = (header_t*)block - 1;
+// The blocks go through the remote-free queues, which the next use of each arena drains.
+static void fork_reclaim(struct thread_stats *t)
+{
+    struct tcache_entry *e, *next;
+    struct thread_quarantine *q = t->quarantine;
+    unsigned i;
+    for (i = 0; i < TCACHE_BINS; i++)
+    {
+        for (e = t->tcache->entries[i]; e; e = next)
+        {
+            next = e->next;
+            e->key = 0;
+            remote_free(block_arena(e), e);
+        }
+        t->tcache->entries[i] = NULL;
+        t->tcache->counts[i] = 0;
+    }
+    for (; q->count; q->count--, q->head = (q->head + 1) % QUARANTINE_MAX)
+        remote_free(block_arena(q->blocks[q->head]), q->blocks[q->head]);
+}
 
-sbrk(0) gives the current value of program break. To check if the block to be freed is at the end of the heap, we first find the end of the current block. The end can be computed as (char*)block + header->s.size. This is then compared with the program break.
+static void malloc_postfork_child(void)
+{
+    struct thread_stats *t, *next;
+    struct latency_hists *l;
+    unsigned i, n = atomic_load(&narenas);
+    pthread_mutex_init(&conf_lock, NULL);
+    pthread_mutex_init(&global_malloc_lock, NULL);
+    for (i = 0; i < n; i++)
+        pthread_mutex_init(&arenas[i].lock, NULL);
+    pthread_mutex_init(&slab_lock, NULL);
+    pthread_mutex_init(&prof_lock, NULL);
+    pthread_mutex_init(&trace_lock, NULL);
+    pthread_mutex_init(&stats_lock, NULL);
+    // Only this thread is left to count, and the arenas of the others are drained as their blocks come back.
+    for (i = 0; i < n; i++)
+        atomic_store(&arenas[i].threads, &arenas[i] == counted_arena);
+    for (t = all_thread_stats; t; t = next)
+    {
+        next = t->next;
+        if (t == &thread_stats)
+            continue;
+        fork_reclaim(t);
+        if ((l = stats_retire(t)))
+            munmap(l, sizeof *l);
+    }
+}
 
-If it is in fact at the end, then we could shrink the size of the heap and release memory to OS. We first reset our head and tail pointers to reflect the loss of the last block. Then the amount of memory to be released is calculated. This the sum of sizes of the header and the acutal block: sizeof(header_t) + header->s.size. To release this much amount of memory, we call sbrk() with the negative of this value.
+// The statistics calls work on a snapshot taken one arena at a time, so nobody has to stop for them.
+// From the arenas' point of view, blocks sitting in a tcache or a remote-free queue are in use.
+struct malloc_snapshot
+{
+    unsigned narenas, nthreads;
+    struct arena_stats arenas[MAX_ARENAS], total;
+    size_t releasable[MAX_ARENAS]; // the free block at the break, which a trim would give back
+    size_t mmap_bytes, mmap_blocks;
+    size_t region_bytes, region_chunks;
+    uint64_t nmalloc[NBINS], nfree[NBINS];
+    uint64_t tcache_hits, tcache_misses, lock_contended;
+};
 
-In the case the block is not the last one in the linked list, we simply set the is_free field of its header. This is the field checked by get_free_block() before actually calling sbrk() on a malloc().
-*/
-void *calloc(size_t num, size_t nsize)
+static void stats_add(struct malloc_snapshot *snap, struct thread_stats *t)
 {
-    size_t size;
-    void *block;
-    if (!num || !nsize)
+    unsigned i;
+    for (i = 0; i < NBINS; i++)
     {
-        return NULL;
+        snap->nmalloc[i] += atomic_load_explicit(&t->nmalloc[i], memory_order_relaxed);
+        snap->nfree[i] += atomic_load_explicit(&t->nfree[i], memory_order_relaxed);
     }
-    size = num * nsize;
-    /* Check overflow */
-    if (nsize != size / num)
+    snap->tcache_hits += atomic_load_explicit(&t->tcache_hits, memory_order_relaxed);
+    snap->tcache_misses += atomic_load_explicit(&t->tcache_misses, memory_order_relaxed);
+    snap->lock_contended += atomic_load_explicit(&t->lock_contended, memory_order_relaxed);
+}
+
+static void stats_snapshot(struct malloc_snapshot *snap)
+{
+    struct malloc_arena *a;
+    struct arena_stats *st;
+    struct thread_stats *t;
+    unsigned i;
+    memset(snap, 0, sizeof *snap);
+    snap->narenas = atomic_load(&narenas);
+    for (i = 0; i < snap->narenas; i++)
     {
-        return NULL;
+        a = &arenas[i];
+        st = &snap->arenas[i];
+        pthread_mutex_lock(&a->lock);
+        *st = a->stats;
+        if (a->fence && (a->fence->s.size & PREV_FREE))
+            snap->releasable[i] = a->fence->s.prev_size;
+        pthread_mutex_unlock(&a->lock);
+        snap->total.system += st->system;
+        snap->total.free_bytes += st->free_bytes;
+        snap->total.free_blocks += st->free_blocks;
+        snap->total.slab_bytes += st->slab_bytes;
+        snap->total.slab_used += st->slab_used;
     }
-    block = malloc(size);
-    if (!block)
+    snap->mmap_bytes = atomic_load_explicit(&mmap_bytes, memory_order_relaxed);
+    snap->mmap_blocks = atomic_load_explicit(&mmap_blocks, memory_order_relaxed);
+    snap->region_bytes = atomic_load_explicit(&region_bytes, memory_order_relaxed);
+    snap->region_chunks = atomic_load_explicit(&region_chunks, memory_order_relaxed);
+    pthread_mutex_lock(&stats_lock);
+    stats_add(snap, &exited_stats);
+    for (t = all_thread_stats; t; t = t->next)
     {
-        return NULL;
+        stats_add(snap, t);
+        snap->nthreads++;
     }
-    memset(block, 0, size);
-    return block;
+    pthread_mutex_unlock(&stats_lock);
 }
 
-void *realloc(void *block, size_t size)
+static const char *lat_op_names[MALLOC_LAT_OPS] = {"malloc", "free", "calloc", "realloc", "aligned"};
+static const char *lat_part_names[MALLOC_LAT_PARTS] = {"fast", "slow", "lock", "os"};
+
+// A histogram of the given thread's, or with cls >= 0 its histogram of whole calls for that class.
+static struct lat_hist *lat_pick(struct latency_hists *l, int op, int part, int cls)
 {
-    header_t *header;
-    void *ret;
-    if (!block || !size)
-        return malloc(size);
-    header = (header_t *)block - 1;
-    if (header->s.size >= size)
-        return block;
-    ret = malloc(size);
-    if (ret)
+    return cls < 0 ? &l->ops[op][part] : &l->classes[op][cls];
+}
+
+// Sums one histogram up over every thread there is and was.
+static void lat_sum(struct lat_hist *sum, int op, int part, int cls)
+{
+    struct thread_stats *t;
+    memset(sum, 0, sizeof *sum);
+    pthread_mutex_lock(&stats_lock);
+    lat_merge(sum, lat_pick(&exited_latency, op, part, cls));
+    for (t = all_thread_stats; t; t = t->next)
     {
-        memcpy(ret, block, header->s.size);
-        free(block);
+        if (t->latency)
+            lat_merge(sum, lat_pick(t->latency, op, part, cls));
+    }
+    pthread_mutex_unlock(&stats_lock);
+}
+
+static void lat_summary(struct lat_hist *h, struct malloc_latency *out)
+{
+    static const double quantiles[] = {0.5, 0.9, 0.99, 0.999};
+    uint64_t *values[] = {&out->p50, &out->p90, &out->p99, &out->p999};
+    uint64_t seen = 0, rank;
+    unsigned b, i;
+    memset(out, 0, sizeof *out);
+    for (b = 0; b < LAT_BUCKETS; b++)
+        out->count += h->count[b];
+    if (!out->count)
+        return;
+    out->mean = h->sum / out->count;
+    out->max = h->max;
+    for (i = 0, b = 0; i < sizeof quantiles / sizeof *quantiles; i++)
+    {
+        rank = (uint64_t)(quantiles[i] * out->count);
+        if (rank < quantiles[i] * out->count || !rank)
+            rank++;
+        while (seen + h->count[b] < rank)
+            seen += h->count[b++];
+        *values[i] = lat_bucket_max(b) < out->max ? lat_bucket_max(b) : out->max;
+    }
+}
+
+int malloc_latency(int op, int part, struct malloc_latency *out)
+{
+    struct lat_hist h;
+    if (op < 0 || op >= MALLOC_LAT_OPS || part < 0 || part >= MALLOC_LAT_PARTS)
+        return -1;
+    lat_sum(&h, op, part, -1);
+    lat_summary(&h, out);
+    return 0;
+}
+
+int malloc_latency_class(int op, size_t size, struct malloc_latency *out)
+{
+    struct lat_hist h;
+    if (op < 0 || op >= MALLOC_LAT_OPS || !size || size > SIZE_MAX - ALIGNMENT)
+        return -1;
+    lat_sum(&h, op, 0, size_class(ALIGN_UP(size, ALIGNMENT)));
+    lat_summary(&h, out);
+    return 0;
+}
+
+// The largest size in a class.
+static size_t class_size(unsigned i)
+{
+    return i < NSMALL_BINS ? (i + 1) * (size_t)ALIGNMENT : SMALL_MAX << (i - NSMALL_BINS + 1);
+}
+
+static size_t in_use(struct arena_stats *st)
+{
+    return st->system - st->free_bytes + st->slab_used;
+}
+
+// Free heap bytes as a share of the heap: memory we hold on to but cannot hand out as one piece.
+static double fragmentation(struct arena_stats *st)
+{
+    return st->system ? (double)st->free_bytes / st->system : 0;
+}
+
+struct mallinfo2 mallinfo2(void)
+{
+    struct malloc_snapshot snap;
+    struct mallinfo2 info;
+    unsigned i;
+    stats_snapshot(&snap);
+    memset(&info, 0, sizeof info);
+    info.arena = snap.total.system + snap.total.slab_bytes;
+    info.ordblks = snap.total.free_blocks;
+    info.hblks = snap.mmap_blocks;
+    info.hblkhd = snap.mmap_bytes;
+    info.uordblks = in_use(&snap.total);
+    info.fsmblks = snap.total.slab_bytes - snap.total.slab_used;
+    info.fordblks = snap.total.free_bytes + info.fsmblks;
+    for (i = 0; i < snap.narenas; i++)
+        info.keepcost += snap.releasable[i];
+    return info;
+}
+
+// Same layout as the glibc report, with our own numbers added at the end.
+void malloc_stats(void)
+{
+    struct malloc_snapshot snap;
+    struct malloc_latency lat;
+    unsigned i, op, part;
+    stats_snapshot(&snap);
+    for (i = 0; i < snap.narenas; i++)
+    {
+        if (!snap.arenas[i].system && !snap.arenas[i].slab_bytes)
+            continue;
+        fprintf(stderr, "Arena %u:\n", i);
+        fprintf(stderr, "system bytes     = %10zu\n", snap.arenas[i].system + snap.arenas[i].slab_bytes);
+        fprintf(stderr, "in use bytes     = %10zu\n", in_use(&snap.arenas[i]));
+    }
+    fprintf(stderr, "Total (incl. mmap):\n");
+    fprintf(stderr, "system bytes     = %10zu\n", snap.total.system + snap.total.slab_bytes + snap.mmap_bytes);
+    fprintf(stderr, "in use bytes     = %10zu\n", in_use(&snap.total) + snap.mmap_bytes);
+    fprintf(stderr, "mmap regions     = %10zu\n", snap.mmap_blocks);
+    fprintf(stderr, "mmap bytes       = %10zu\n", snap.mmap_bytes);
+    fprintf(stderr, "region chunks    = %10zu\n", snap.region_chunks);
+    fprintf(stderr, "region bytes     = %10zu\n", snap.region_bytes);
+    fprintf(stderr, "fragmentation    = %10.4f\n", fragmentation(&snap.total));
+    fprintf(stderr, "tcache hits      = %10llu\n", (unsigned long long)snap.tcache_hits);
+    fprintf(stderr, "tcache misses    = %10llu\n", (unsigned long long)snap.tcache_misses);
+    fprintf(stderr, "lock contended   = %10llu\n", (unsigned long long)snap.lock_contended);
+    if (!latency_stats)
+        return;
+    fprintf(stderr, "latency (ns)          count      p50      p99    p99.9      max\n");
+    for (op = 0; op < MALLOC_LAT_OPS; op++)
+    {
+        for (part = 0; part < MALLOC_LAT_PARTS; part++)
+        {
+            malloc_latency(op, part, &lat);
+            if (lat.count)
+                fprintf(stderr, "%-7s %-4s %12llu %8llu %8llu %8llu %8llu\n", lat_op_names[op], lat_part_names[part],
+                        (unsigned long long)lat.count, (unsigned long long)lat.p50, (unsigned long long)lat.p99,
+                        (unsigned long long)lat.p999, (unsigned long long)lat.max);
+        }
     }
-    return ret;
+}
+
+struct json_out
+{
+    char *buf;
+    size_t size, len;
+};
+
+static void json_printf(struct json_out *out, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+    va_start(ap, fmt);
+    if (out->len < out->size)
+        n = vsnprintf(out->buf + out->len, out->size - out->len, fmt, ap);
+    else
+        n = vsnprintf(NULL, 0, fmt, ap);
+    va_end(ap);
+    if (n > 0)
+        out->len += n;
+}
+
+static void json_latency(struct json_out *out, const char *name, struct malloc_latency *lat)
+{
+    json_printf(out, "\"%s\":{\"count\":%llu,\"mean\":%llu,\"p50\":%llu,\"p90\":%llu,\"p99\":%llu,\"p999\":%llu,"
+                     "\"max\":%llu}",
+                name, (unsigned long long)lat->count, (unsigned long long)lat->mean, (unsigned long long)lat->p50,
+                (unsigned long long)lat->p90, (unsigned long long)lat->p99, (unsigned long long)lat->p999,
+                (unsigned long long)lat->max);
+}
+
+size_t malloc_stats_json(char *buf, size_t size)
+{
+    struct malloc_snapshot snap;
+    struct json_out out = {buf, size, 0};
+    struct arena_stats *st;
+    struct malloc_latency lat;
+    const char *sep = "", *sep2;
+    unsigned i, op, part;
+    stats_snapshot(&snap);
+    json_printf(&out, "{\"arenas\":[");
+    for (i = 0; i < snap.narenas; i++)
+    {
+        st = &snap.arenas[i];
+        json_printf(&out, "%s{\"id\":%u,\"node\":%u,\"system\":%zu,\"in_use\":%zu,\"free\":%zu,\"free_blocks\":%zu,"
+                          "\"slab\":%zu,\"slab_used\":%zu,\"releasable\":%zu,\"fragmentation\":%.4f}",
+                    i ? "," : "", i, i % numa_nodes, st->system, in_use(st), st->free_bytes, st->free_blocks, st->slab_bytes, st->slab_used,
+                    snap.releasable[i], fragmentation(st));
+    }
+    st = &snap.total;
+    json_printf(&out, "],\"total\":{\"system\":%zu,\"in_use\":%zu,\"free\":%zu,\"slab\":%zu,\"slab_used\":%zu,"
+                      "\"fragmentation\":%.4f},\"mmap\":{\"bytes\":%zu,\"blocks\":%zu},"
+                      "\"regions\":{\"bytes\":%zu,\"chunks\":%zu},",
+                st->system + st->slab_bytes + snap.mmap_bytes, in_use(st) + snap.mmap_bytes, st->free_bytes, st->slab_bytes,
+                st->slab_used, fragmentation(st), snap.mmap_bytes, snap.mmap_blocks, snap.region_bytes, snap.region_chunks);
+    json_printf(&out, "\"threads\":{\"live\":%u,\"tcache_hits\":%llu,\"tcache_misses\":%llu,\"lock_contended\":%llu},",
+                snap.nthreads, (unsigned long long)snap.tcache_hits, (unsigned long long)snap.tcache_misses,
+                (unsigned long long)snap.lock_contended);
+    // Latencies are only there with latency_stats on, and only the parts that have any.
+    if (latency_stats)
+    {
+        json_printf(&out, "\"latency\":{");
+        for (op = 0; op < MALLOC_LAT_OPS; op++)
+        {
+            json_printf(&out, "%s\"%s\":{", op ? "," : "", lat_op_names[op]);
+            for (part = 0, sep2 = ""; part < MALLOC_LAT_PARTS; part++)
+            {
+                malloc_latency(op, part, &lat);
+                if (!lat.count)
+                    continue;
+                json_printf(&out, "%s", sep2);
+                json_latency(&out, lat_part_names[part], &lat);
+                sep2 = ",";
+            }
+            json_printf(&out, "}");
+        }
+        json_printf(&out, "},");
+    }
+    // Classes are named by their largest size; only the ones that saw any traffic are listed.
+    json_printf(&out, "\"classes\":[");
+    for (i = 0; i < NBINS; i++)
+    {
+        if (!snap.nmalloc[i] && !snap.nfree[i])
+            continue;
+        json_printf(&out, "%s{\"size\":%zu,\"nmalloc\":%llu,\"nfree\":%llu", sep, class_size(i),
+                    (unsigned long long)snap.nmalloc[i], (unsigned long long)snap.nfree[i]);
+        if (latency_stats)
+        {
+            json_printf(&out, ",\"latency\":{");
+            for (op = 0, sep2 = ""; op < MALLOC_LAT_OPS; op++)
+            {
+                malloc_latency_class(op, class_size(i), &lat);
+                if (!lat.count)
+                    continue;
+                json_printf(&out, "%s", sep2);
+                json_latency(&out, lat_op_names[op], &lat);
+                sep2 = ",";
+            }
+            json_printf(&out, "}");
+        }
+        json_printf(&out, "}");
+        sep = ",";
+    }
+    json_printf(&out, "]}");
+    return out.len;
 }
 
 /* A debug function to print the entire link list */
 void print_mem_list()
 {
-    header_t *curr = head;
-    printf("head = %p, tail = %p \n", (void *)head, (void *)tail);
-    while (curr)
+    struct malloc_arena *a;
+    struct heap_region *region;
+    header_t *curr;
+    unsigned i, n = atomic_load(&narenas);
+    for (a = arenas; a < arenas + n; a++)
     {
-        printf("addr = %p, size = %zu, is_free=%u, next=%p\n",
-               (void *)curr, curr->s.size, curr->s.is_free, (void *)curr->s.next);
-        curr = curr->s.next;
+        printf("arena %u: fence = %p \n", (unsigned)(a - arenas), (void *)a->fence);
+        for (region = a->regions; region; region = region->next)
+        {
+            printf("region %p:\n", (void *)region);
+            for (curr = (header_t *)(region + 1); block_size(curr); curr = next_block(curr))
+                printf("addr = %p, size = %zu, is_free=%u, prev_free=%u\n", (void *)curr, block_size(curr),
+                       (unsigned)(curr->s.size & BLOCK_FREE), (unsigned)(curr->s.size & PREV_FREE) >> 1);
+        }
+        for (i = 0; i < NBINS; i++)
+        {
+            if (!a->bins[i])
+                continue;
+            printf("bin %u:", i);
+            for (curr = a->bins[i]; curr; curr = links(curr)->next)
+                printf(" %p", (void *)curr);
+            printf("\n");
+        }
+        for (i = 0; i < SLAB_CLASSES; i++)
+        {
+            struct slab_run *run;
+            if (!a->slab_runs[i])
+                continue;
+            printf("slab %zu:", (i + 1) * (size_t)ALIGNMENT);
+            for (run = a->slab_runs[i]; run; run = run->next)
+                printf(" %p (%u/%u free)", (void *)run, run->nfree, run->nslots);
+            printf("\n");
+        }
     }
 }
@@ -0,0 +1,135 @@
+// Extensions to the standard allocator interface. mallinfo2(), malloc_stats() and malloc_usable_size() are declared
+// by <malloc.h>.
+#ifndef MEMALLOC_H
+#define MEMALLOC_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// jemalloc style allocation: the low 6 bits of flags are the log2 of the alignment, and MALLOCX_ISOLATE gives the block
+// whole cache lines that it shares with no other block, against false sharing between threads.
+#define MALLOCX_ISOLATE 0x80
+void *mallocx(size_t size, int flags);
+
+// C23 sized deallocation: size (and alignment) must be what the block was allocated with. Small blocks then go back
+// without their header being read. sdallocx() is the jemalloc spelling, with the flags given to mallocx().
+void free_sized(void *ptr, size_t size);
+void free_aligned_sized(void *ptr, size_t alignment, size_t size);
+void sdallocx(void *ptr, size_t size, int flags);
+
+// The usable size mallocx(size, flags), and so malloc(size) for flags 0, gives at the least, as malloc_usable_size()
+// would report it: what a growing buffer can ask for without wasting the rounding. 0 if size is 0 or too big.
+// malloc_usable_size() of the block itself may be a little more.
+size_t nallocx(size_t size, int flags);
+
+// Allocates up to n blocks of size bytes into ptrs, taking the arena lock at most once, and returns how many it got:
+// fewer than n only when memory ran out. free_batch() frees n blocks (NULLs are skipped) the same way.
+size_t malloc_batch(size_t size, size_t n, void **ptrs);
+void free_batch(void **ptrs, size_t n);
+
+// Writes the allocator statistics into buf as a JSON document, the way snprintf() would: at most size bytes including
+// the terminating NUL are written, and the return value is the length of the whole document.
+size_t malloc_stats_json(char *buf, size_t size);
+
+// Reads and sets the tuning options by name, jemalloc style: the old value is copied to oldp, whose size *oldlenp must
+// be the option's, and a new one is taken from newp. Sizes are size_t, decay_ms is long, arenas, tcache_count and
+// quarantine are unsigned, the prefixes are const char * and the rest are int. Returns 0, ENOENT for an unknown name,
+// EINVAL for a bad value and EPERM for an option that can only be set before the first allocation. The same options
+// can be given in the MEMALLOC_CONF environment variable as name=value,name=value.
+//     mmap_threshold, trim_threshold, top_pad, arenas*, tcache_max, tcache_count, placement (first, best,
+//     address, next), cache_align*, decay_ms, decay_thread*, huge_pages* (off, thp, hugetlb), numa*,
+//     latency_stats*, prof_sample_bytes*, prof_signal*, prof_prefix, trace_prefix*, hardened*, quarantine
+//                                                                         (* only before the first allocation)
+int mallctl(const char *name, void *oldp, size_t *oldlenp, void *newp, size_t newlen);
+
+// Writes the heap profile (see prof_sample_bytes) to path, as a pprof heap profile or as collapsed stacks for flame
+// graphs. Returns 0, or -1 if the file could not be written.
+#define MALLOC_PROF_PPROF 0
+#define MALLOC_PROF_COLLAPSED 1
+int malloc_prof_dump(const char *path, int format);
+
+// Regions, for objects that all die at the same time. arena_alloc() bumps a pointer through chunks mapped from the OS,
+// and arena_reset() and arena_destroy() drop everything at once, at a cost per chunk rather than per object.
+// Blocks of a region are 16 byte aligned and must not be passed to free() or realloc(). A region is not thread safe:
+// use one per thread, or lock it.
+struct malloc_region;
+
+struct malloc_region *arena_create(void);
+void *arena_alloc(struct malloc_region *region, size_t size);
+// Frees every block of the region. The newest chunk is kept for the blocks to come, the others are unmapped.
+void arena_reset(struct malloc_region *region);
+void arena_destroy(struct malloc_region *region);
+
+// Latency histograms (see latency_stats), in nanoseconds. Every call is timed as a whole and filed as fast, if it took
+// no arena lock and made no OS call, or as slow; the time it spent waiting for locks and in the OS is filed as well.
+#define MALLOC_LAT_MALLOC 0
+#define MALLOC_LAT_FREE 1
+#define MALLOC_LAT_CALLOC 2
+#define MALLOC_LAT_REALLOC 3
+#define MALLOC_LAT_ALIGNED 4 // posix_memalign() and friends
+#define MALLOC_LAT_OPS 5
+
+#define MALLOC_LAT_FAST 0 // whole calls that took no lock and made no OS call
+#define MALLOC_LAT_SLOW 1 // whole calls that did
+#define MALLOC_LAT_LOCK 2 // time waiting for arena locks, of the calls that had to wait
+#define MALLOC_LAT_OS 3   // time in sbrk(), mmap(), munmap() and madvise(), of the calls that made any
+#define MALLOC_LAT_PARTS 4
+
+// Quantiles are the upper bound of the histogram bucket they fall in, so they are at most 25% high.
+struct malloc_latency
+{
+    uint64_t count, mean, p50, p90, p99, p999, max;
+};
+
+// Fills *out with the latencies of one part of op. Returns 0, or -1 for an op or part that does not exist.
+int malloc_latency(int op, int part, struct malloc_latency *out);
+
+// Fills *out with the latencies of whole calls of op for blocks of the size class of size.
+int malloc_latency_class(int op, size_t size, struct malloc_latency *out);
+
+// Allocation traces (see trace_prefix). A trace file is a struct malloc_trace_header followed by records, in the order
+// the threads flushed them: every thread's records are in order, but the file as a whole has to be sorted by time.
+#define MALLOC_TRACE_MAGIC "MEMTRACE"
+#define MALLOC_TRACE_VERSION 1
+
+enum malloc_trace_op
+{
+    MALLOC_TRACE_MALLOC,
+    MALLOC_TRACE_CALLOC,
+    MALLOC_TRACE_FREE,
+    MALLOC_TRACE_REALLOC_FROM, // the block realloc() was passed, immediately followed by the thread's REALLOC_TO
+    MALLOC_TRACE_REALLOC_TO,   // the block realloc() returned
+    MALLOC_TRACE_ALIGNED,      // posix_memalign() and friends
+};
+
+struct malloc_trace_header
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// Blocks are identified by their address, which is unique among the live ones. Frees are stamped before the call and
+// allocations after it, so a block freed by one thread and handed out again to another stays in the right order.
+struct malloc_trace_record
+{
+    uint64_t time_ns; // CLOCK_MONOTONIC
+    uint64_t id;      // 0 for a failed allocation
+    uint64_t size;
+    uint32_t thread;  // numbered from 1 in order of the first traced call
+    uint16_t op;
+    uint16_t align_log2;
+};
+
+// Prints every block of every arena, for debugging.
+void print_mem_list(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
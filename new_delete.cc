@@ -0,0 +1,161 @@
+// The global operator new and delete, so that C++ programs get the allocator too. Sized delete knows the size of the
+// block, so it goes through free_sized() and small blocks go back without their header being read.
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include "memalloc.h"
+
+namespace
+{
+// What the standard asks of new: call the new_handler until memory turns up, and throw once there is no handler.
+// Zero bytes still get a block of their own, which malloc(0) would not give.
+void *allocate(std::size_t size)
+{
+    void *block;
+    while (!(block = std::malloc(size ? size : 1)))
+    {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+    return block;
+}
+
+void *allocate_aligned(std::size_t size, std::align_val_t alignment)
+{
+    void *block;
+    while (!(block = aligned_alloc(static_cast<std::size_t>(alignment), size ? size : 1)))
+    {
+        std::new_handler handler = std::get_new_handler();
+        if (!handler)
+            throw std::bad_alloc();
+        handler();
+    }
+    return block;
+}
+
+void *allocate_nothrow(std::size_t size) noexcept
+{
+    try
+    {
+        return allocate(size);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+
+void *allocate_aligned_nothrow(std::size_t size, std::align_val_t alignment) noexcept
+{
+    try
+    {
+        return allocate_aligned(size, alignment);
+    }
+    catch (...)
+    {
+        return nullptr;
+    }
+}
+}
+
+void *operator new(std::size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new[](std::size_t size)
+{
+    return allocate(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+    return allocate_nothrow(size);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment)
+{
+    return allocate_aligned(size, alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment)
+{
+    return allocate_aligned(size, alignment);
+}
+
+void *operator new(std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate_aligned_nothrow(size, alignment);
+}
+
+void *operator new[](std::size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return allocate_aligned_nothrow(size, alignment);
+}
+
+void operator delete(void *block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, std::size_t size) noexcept
+{
+    free_sized(block, size);
+}
+
+void operator delete[](void *block, std::size_t size) noexcept
+{
+    free_sized(block, size);
+}
+
+void operator delete(void *block, std::align_val_t) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block, std::align_val_t) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
+
+void operator delete[](void *block, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    std::free(block);
+}
+
+void operator delete(void *block, std::size_t size, std::align_val_t alignment) noexcept
+{
+    free_aligned_sized(block, static_cast<std::size_t>(alignment), size);
+}
+
+void operator delete[](void *block, std::size_t size, std::align_val_t alignment) noexcept
+{
+    free_aligned_sized(block, static_cast<std::size_t>(alignment), size);
+}
@@ -0,0 +1,519 @@
+// Replays an allocation trace (see trace_prefix in main.c) against whatever allocator it runs on; like bench, it only
+// calls the standard interface, so the allocator is picked with LD_PRELOAD:
+//     LD_PRELOAD=./libmemalloc.so tools/replay memalloc.1234.trace
+//
+// usage: replay [-s] <trace>
+//     -s  run every call on one thread in the order of the trace, instead of one thread per traced thread
+//
+// Every traced thread gets a thread of its own that makes the same calls in the same order. A block freed by a
+// different thread than the one that allocated it is waited for, so the calls happen in an order the program could
+// have made them in, but with no other pacing than that. Prints the latency percentiles of every kind of call, the
+// peak RSS and the fragmentation: peak RSS over the peak of bytes the trace had live.
+// Everything replay keeps for itself is mmapped, stdout's buffer too, and it sorts in place and reads /proc without
+// stdio. What else reaches the allocator under test is libc's own: whatever it and the loader allocate before main(),
+// and one small calloc() for the thread-local storage of every replay thread, made by pthread_create() before the
+// replay starts.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include "../memalloc.h"
+
+#define NO_SLOT UINT32_MAX
+#define SKIP UINT16_MAX
+#define FAILED ((void *)-1) // a replayed allocation that returned NULL
+
+enum
+{
+    KIND_MALLOC,
+    KIND_CALLOC,
+    KIND_FREE,
+    KIND_REALLOC,
+    KIND_ALIGNED,
+    NKINDS
+};
+
+static const char *kind_names[NKINDS] = {"malloc", "calloc", "free", "realloc", "aligned"};
+
+// A call to make. Blocks are numbered in the order the trace allocated them: slot is the block an allocation makes or
+// the one a free gives back, from is the block realloc() is passed.
+struct event
+{
+    uint64_t time;
+    uint64_t id;
+    uint64_t size;
+    uint32_t seq;
+    uint32_t thread;
+    uint32_t slot, from;
+    uint16_t kind;
+    uint16_t align_log2;
+};
+
+struct worker
+{
+    pthread_t thread;
+    uint32_t *events;
+    size_t n;
+};
+
+static struct event *events;
+static size_t nevents;
+static _Atomic(void *) *slots;
+static uint64_t *latency;
+static pthread_barrier_t start_barrier;
+
+static void *table(size_t n, size_t size)
+{
+    void *p = mmap(NULL, n ? n * size : size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (p == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    // Fault everything in now, so it is part of the RSS before the replay starts.
+    memset(p, 0, n * size);
+    return p;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+// Not with fopen(), which mallocs the FILE.
+static size_t current_rss_kb(void)
+{
+    unsigned long size = 0, resident = 0;
+    char buf[128];
+    ssize_t n;
+    int fd = open("/proc/self/statm", O_RDONLY);
+    if (fd >= 0)
+    {
+        n = read(fd, buf, sizeof buf - 1);
+        buf[n > 0 ? n : 0] = 0;
+        if (sscanf(buf, "%lu %lu", &size, &resident) != 2)
+            resident = 0;
+        close(fd);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static int by_time(const void *x, const void *y)
+{
+    const struct event *a = x, *b = y;
+    if (a->time != b->time)
+        return a->time < b->time ? -1 : 1;
+    return a->seq < b->seq ? -1 : a->seq > b->seq;
+}
+
+static int by_value(const void *x, const void *y)
+{
+    uint64_t a = *(const uint64_t *)x, b = *(const uint64_t *)y;
+    return a < b ? -1 : a > b;
+}
+
+// Heap sort, in place: qsort() may take its scratch space from the allocator under test, and it would still be part
+// of the peak RSS if it came from mmap.
+static void swap_bytes(char *a, char *b, size_t size)
+{
+    char t;
+    while (size--)
+    {
+        t = *a;
+        *a++ = *b;
+        *b++ = t;
+    }
+}
+
+static void sift_down(char *base, size_t root, size_t n, size_t size, int (*cmp)(const void *, const void *))
+{
+    size_t child;
+    while ((child = 2 * root + 1) < n)
+    {
+        if (child + 1 < n && cmp(base + child * size, base + (child + 1) * size) < 0)
+            child++;
+        if (cmp(base + root * size, base + child * size) >= 0)
+            return;
+        swap_bytes(base + root * size, base + child * size, size);
+        root = child;
+    }
+}
+
+static void sort(void *base, size_t n, size_t size, int (*cmp)(const void *, const void *))
+{
+    size_t i;
+    for (i = n / 2; i--;)
+        sift_down(base, i, n, size, cmp);
+    for (i = n; i-- > 1;)
+    {
+        swap_bytes(base, (char *)base + i * size, size);
+        sift_down(base, 0, i, size, cmp);
+    }
+}
+
+// Live blocks of the trace by address, for numbering them: open addressing with linear probing.
+static uint64_t *map_keys;
+static uint32_t *map_slots;
+static size_t map_mask;
+
+static size_t map_home(uint64_t id)
+{
+    return (id * 0x9e3779b97f4a7c15ull >> 20) & map_mask;
+}
+
+static void map_insert(uint64_t id, uint32_t slot)
+{
+    size_t i = map_home(id);
+    while (map_keys[i] && map_keys[i] != id)
+        i = (i + 1) & map_mask;
+    map_keys[i] = id;
+    map_slots[i] = slot;
+}
+
+// Removes id and returns its slot, or NO_SLOT for a block the trace never saw allocated.
+static uint32_t map_remove(uint64_t id)
+{
+    size_t i = map_home(id), j, home;
+    uint32_t slot;
+    while (map_keys[i] != id)
+    {
+        if (!map_keys[i])
+            return NO_SLOT;
+        i = (i + 1) & map_mask;
+    }
+    slot = map_slots[i];
+    // Move later entries of the probe run back into the hole, so no lookup stops short of them.
+    for (j = (i + 1) & map_mask; map_keys[j]; j = (j + 1) & map_mask)
+    {
+        home = map_home(map_keys[j]);
+        if (((j - home) & map_mask) >= ((j - i) & map_mask))
+        {
+            map_keys[i] = map_keys[j];
+            map_slots[i] = map_slots[j];
+            i = j;
+        }
+    }
+    map_keys[i] = 0;
+    return slot;
+}
+
+static void load(const char *path)
+{
+    struct malloc_trace_header h;
+    struct malloc_trace_record *r;
+    struct stat st;
+    size_t i;
+    void *data;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) < 0)
+    {
+        fprintf(stderr, "%s: %s\n", path, strerror(errno));
+        exit(1);
+    }
+    if ((size_t)st.st_size < sizeof h || pread(fd, &h, sizeof h, 0) != sizeof h ||
+        memcmp(h.magic, MALLOC_TRACE_MAGIC, sizeof h.magic) || h.version != MALLOC_TRACE_VERSION ||
+        h.record_size != sizeof *r)
+    {
+        fprintf(stderr, "%s: not a version %d allocation trace\n", path, MALLOC_TRACE_VERSION);
+        exit(1);
+    }
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (data == MAP_FAILED)
+    {
+        perror("mmap");
+        exit(1);
+    }
+    close(fd);
+    nevents = (st.st_size - sizeof h) / sizeof *r;
+    r = (struct malloc_trace_record *)((char *)data + sizeof h);
+    events = table(nevents, sizeof *events);
+    for (i = 0; i < nevents; i++)
+    {
+        events[i].time = r[i].time_ns;
+        events[i].size = r[i].size;
+        events[i].seq = i;
+        events[i].thread = r[i].thread;
+        events[i].kind = r[i].op;
+        events[i].align_log2 = r[i].align_log2;
+        events[i].id = r[i].id;
+    }
+    munmap(data, st.st_size);
+    // Every thread flushed its own records in order, so sorting by time with the file order breaking ties keeps
+    // every thread's calls in the order it made them.
+    sort(events, nevents, sizeof *events, by_time);
+}
+
+// Numbers the blocks in the order of the trace and turns records into calls: a realloc()'s FROM record is folded into
+// its TO record, and calls replay cannot make the same way are skipped (frees of blocks allocated before the trace
+// started, failed allocations). Returns the number of blocks and sets *peak_live to the peak of bytes live.
+static uint32_t number(uint32_t nthreads, size_t *peak_live)
+{
+    uint32_t nslots = 0, *pending = table(nthreads + 1, sizeof *pending);
+    uint64_t *pending_id = table(nthreads + 1, sizeof *pending_id), *sizes = table(nevents, sizeof *sizes), id;
+    size_t i, cap = 16, live = 0;
+    struct event *e;
+    while (cap < 2 * nevents)
+        cap *= 2;
+    map_keys = table(cap, sizeof *map_keys);
+    map_slots = table(cap, sizeof *map_slots);
+    map_mask = cap - 1;
+    *peak_live = 0;
+    for (i = 0; i < nevents; i++)
+    {
+        e = &events[i];
+        id = e->id;
+        e->slot = e->from = NO_SLOT;
+        switch (e->kind)
+        {
+        case MALLOC_TRACE_FREE:
+            e->kind = KIND_FREE;
+            if ((e->slot = map_remove(id)) == NO_SLOT)
+                e->kind = SKIP;
+            else
+                live -= sizes[e->slot];
+            continue;
+        case MALLOC_TRACE_REALLOC_FROM:
+            pending[e->thread] = id ? map_remove(id) : NO_SLOT;
+            pending_id[e->thread] = id;
+            if (pending[e->thread] != NO_SLOT)
+                live -= sizes[pending[e->thread]];
+            e->kind = SKIP;
+            continue;
+        case MALLOC_TRACE_REALLOC_TO:
+            e->kind = KIND_REALLOC;
+            e->from = pending[e->thread];
+            if (!id && e->size && e->from != NO_SLOT)
+            {
+                // It failed and the old block is still there.
+                map_insert(pending_id[e->thread], e->from);
+                live += sizes[e->from];
+                e->kind = SKIP;
+                continue;
+            }
+            if (!e->size)
+            {
+                // realloc(p, 0) is up to the allocator; replay it as the free() it is with us.
+                e->kind = e->from == NO_SLOT ? SKIP : KIND_FREE;
+                e->slot = e->from;
+                continue;
+            }
+            break;
+        case MALLOC_TRACE_MALLOC:
+            e->kind = KIND_MALLOC;
+            break;
+        case MALLOC_TRACE_CALLOC:
+            e->kind = KIND_CALLOC;
+            break;
+        case MALLOC_TRACE_ALIGNED:
+            e->kind = KIND_ALIGNED;
+            break;
+        default:
+            e->kind = SKIP;
+            continue;
+        }
+        if (!id)
+        {
+            e->kind = SKIP;
+            continue;
+        }
+        e->slot = nslots++;
+        sizes[e->slot] = e->size;
+        map_insert(id, e->slot);
+        live += e->size;
+        if (live > *peak_live)
+            *peak_live = live;
+    }
+    return nslots;
+}
+
+// Pages the program would have written to; a block nobody touches costs no RSS.
+static void touch(char *block, size_t size)
+{
+    size_t i;
+    for (i = 0; i < size; i += 4096)
+        block[i] = 1;
+}
+
+// Waits until the thread that allocates the block has done so.
+static void *wait_for(uint32_t slot)
+{
+    void *block;
+    unsigned spins = 0;
+    while (!(block = atomic_load_explicit(&slots[slot], memory_order_acquire)))
+    {
+        if (++spins > 64)
+            sched_yield();
+    }
+    return block;
+}
+
+static void replay_event(uint32_t i)
+{
+    struct event *e = &events[i];
+    void *block = NULL, *old;
+    uint64_t start, end;
+    size_t align;
+    switch (e->kind)
+    {
+    case KIND_MALLOC:
+        start = now_ns();
+        block = malloc(e->size);
+        end = now_ns();
+        break;
+    case KIND_CALLOC:
+        start = now_ns();
+        block = calloc(1, e->size);
+        end = now_ns();
+        break;
+    case KIND_ALIGNED:
+        align = (size_t)1 << e->align_log2;
+        if (align < sizeof(void *))
+            align = sizeof(void *);
+        start = now_ns();
+        if (posix_memalign(&block, align, e->size))
+            block = NULL;
+        end = now_ns();
+        break;
+    case KIND_REALLOC:
+        old = e->from == NO_SLOT ? NULL : wait_for(e->from);
+        if (old == FAILED)
+            old = NULL;
+        start = now_ns();
+        block = realloc(old, e->size);
+        end = now_ns();
+        break;
+    case KIND_FREE:
+        if ((old = wait_for(e->slot)) == FAILED)
+            return;
+        start = now_ns();
+        free(old);
+        end = now_ns();
+        latency[i] = end - start;
+        return;
+    default:
+        return;
+    }
+    latency[i] = end - start;
+    if (block)
+        touch(block, e->size);
+    atomic_store_explicit(&slots[e->slot], block ? block : FAILED, memory_order_release);
+}
+
+static void *run_worker(void *arg)
+{
+    struct worker *w = arg;
+    size_t i;
+    pthread_barrier_wait(&start_barrier);
+    for (i = 0; i < w->n; i++)
+        replay_event(w->events[i]);
+    return NULL;
+}
+
+static void report(void)
+{
+    uint64_t *values = table(nevents, sizeof *values), sum;
+    size_t i, n;
+    unsigned k;
+    printf("%-8s %10s %8s %8s %8s %8s %8s %10s  (ns)\n", "call", "count", "mean", "p50", "p90", "p99", "p99.9", "max");
+    for (k = 0; k < NKINDS; k++)
+    {
+        for (i = n = 0, sum = 0; i < nevents; i++)
+        {
+            if (events[i].kind == k)
+            {
+                values[n++] = latency[i];
+                sum += latency[i];
+            }
+        }
+        if (!n)
+            continue;
+        sort(values, n, sizeof *values, by_value);
+        printf("%-8s %10zu %8llu %8llu %8llu %8llu %8llu %10llu\n", kind_names[k], n, (unsigned long long)(sum / n),
+               (unsigned long long)values[n / 2], (unsigned long long)values[n * 90 / 100],
+               (unsigned long long)values[n * 99 / 100], (unsigned long long)values[n * 999 / 1000],
+               (unsigned long long)values[n - 1]);
+    }
+    munmap(values, nevents * sizeof *values);
+}
+
+int main(int argc, char **argv)
+{
+    struct worker *workers;
+    struct rusage usage;
+    uint32_t nthreads = 0, nslots, t;
+    size_t i, peak_live, base_rss;
+    uint64_t start, end;
+    int serial = 0;
+    const char *path;
+    setvbuf(stdout, table(BUFSIZ, 1), _IOLBF, BUFSIZ);
+    if (argc > 1 && !strcmp(argv[1], "-s"))
+    {
+        serial = 1;
+        argv++;
+        argc--;
+    }
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: replay [-s] <trace>\n");
+        return 2;
+    }
+    path = argv[1];
+    load(path);
+    for (i = 0; i < nevents; i++)
+    {
+        if (events[i].thread > nthreads)
+            nthreads = events[i].thread;
+    }
+    nslots = number(nthreads, &peak_live);
+    slots = table(nslots, sizeof *slots);
+    latency = table(nevents, sizeof *latency);
+    workers = table(serial ? 1 : nthreads, sizeof *workers);
+    for (i = 0; i < nevents; i++)
+    {
+        if (events[i].kind != SKIP)
+            workers[serial ? 0 : events[i].thread - 1].n++;
+    }
+    for (t = 0; t < (serial ? 1 : nthreads); t++)
+    {
+        workers[t].events = table(workers[t].n, sizeof *workers[t].events);
+        workers[t].n = 0;
+    }
+    for (i = 0; i < nevents; i++)
+    {
+        if (events[i].kind != SKIP)
+            workers[serial ? 0 : events[i].thread - 1].events[workers[serial ? 0 : events[i].thread - 1].n++] = i;
+    }
+    if (serial)
+        nthreads = 1;
+    base_rss = current_rss_kb();
+    pthread_barrier_init(&start_barrier, NULL, nthreads + 1);
+    for (t = 0; t < nthreads; t++)
+        pthread_create(&workers[t].thread, NULL, run_worker, &workers[t]);
+    pthread_barrier_wait(&start_barrier);
+    start = now_ns();
+    for (t = 0; t < nthreads; t++)
+        pthread_join(workers[t].thread, NULL);
+    end = now_ns();
+    getrusage(RUSAGE_SELF, &usage);
+    printf("%s: %zu records, %u blocks, %u %s, peak live %zu KiB\n", path, nevents, nslots, nthreads,
+           serial ? "thread (serial)" : "threads", peak_live / 1024);
+    printf("replayed in %.3f s\n", (end - start) / 1e9);
+    report();
+    // The baseline is replay's own tables, the binary and libraries; what the heap added on top is the heap's.
+    printf("peak rss %ld KiB, %ld KiB above the baseline, fragmentation %.2f\n", usage.ru_maxrss,
+           usage.ru_maxrss - (long)base_rss,
+           peak_live ? (usage.ru_maxrss - (double)base_rss) * 1024 / peak_live : 0.0);
+    return 0;
+}